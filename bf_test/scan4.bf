@@ -0,0 +1,10 @@
+zero search benchmark with a stride of four
+
+fills about 25000 cells then walks to the end of them and back with
+scan loops 10000 times before printing OK
+
+++++++[->>>>++++<<<<]>>>>>>>>+<<<<
+[[>>>>]-[[->>>>+<<<<]+>>>>-]<<<<[<<<<]>>>>-]
+<<<<++++++++[->>>>+++++<<<<]>>>>
+[>>>>[-]------[[>>>>]<<<<[<<<<]>>>>>>>>-]<<<<-]
+<<<<+++++++++[->>>>+++++++++<<<<]>>>>--.----.[-]++++++++++.
@@ -9,12 +9,12 @@
 
 typedef struct {
   vec_t(uint8_t);
-  Elf32_Phdr header;
+  Elf64_Phdr header;
 } program_t;
 
 typedef struct {
   vec_t(uint8_t);
-  Elf32_Shdr header;
+  Elf64_Shdr header;
 } section_t;
 
 typedef map_t(program_t) program_map_t;
@@ -25,17 +25,18 @@ typedef struct {
 } section_map_t;
 
 typedef struct {
-  Elf32_Ehdr elf_header;
+  Elf64_Ehdr elf_header;
   program_map_t segments;
   section_map_t sections;
 } elf_gen_ctx;
 
-elf_gen_ctx elf_gen_ctx_init();
+/* elf_class is ELFCLASS32 or ELFCLASS64 */
+elf_gen_ctx elf_gen_ctx_init(uint8_t elf_class, uint16_t machine);
 
 void elf_gen_ctx_free(elf_gen_ctx *ctx);
 
 program_t *gen_program_header(elf_gen_ctx *ctx, const char *name,
-                              Elf32_Phdr header);
+                              Elf64_Phdr header);
 section_t *gen_section_header(elf_gen_ctx *ctx, const char *name,
-                              Elf32_Shdr header);
+                              Elf64_Shdr header);
 void gen_elf_file(FILE *fp, elf_gen_ctx *ctx);
@@ -4,9 +4,60 @@
 #include "ir_gen.h"
 #include <stdint.h>
 
+typedef enum {
+  TARGET_I386 = 0,
+  TARGET_X86_64 = 1 << 0, /* long mode encodings and syscalls */
+  TARGET_JIT = 1 << 1,    /* called in process, returning instead of exiting */
+} compile_target_t;
+
+/* where the code and the data it works on live at run time. everything but
+ * the routines has to be filled in before compiling. the code only uses 32 bit
+ * addresses, so on x86-64 all of it has to sit in the low 4G. */
+typedef struct {
+  compile_target_t target;
+  uint32_t code;    /* address the code buffer gets loaded at */
+  uint32_t tape;    /* the first cell */
+  uint32_t sp;      /* initial tape pointer */
+  uint8_t cell_size; /* bytes to a cell, 1, 2 or 4 */
+  uint32_t out_buf; /* buffered output */
+  uint32_t out_len;
+  uint32_t in_buf; /* buffered input */
+  uint32_t in_len;
+  uint32_t in_ptr; /* next unread byte of in_buf, followed by its end */
+  int32_t eof;     /* what a read stores at the end of input */
+  uint32_t front_guard; /* left unmapped in front of the tape */
+  uint32_t guard;       /* and past the end of it */
+  uint32_t guard_len;   /* the length of each */
+  uint32_t flush;  /* routine writing out the output buffer */
+  uint32_t getc;   /* routine refilling the input buffer */
+} compile_layout_t;
+
+/* what the code emitted so far leaves behind, for the peephole optimizations.
+ * the ends are 0 when unset. */
+typedef struct {
+  size_t add_at, add_end; /* the last add/sub, when it can be folded into */
+  int add_mode;           /* mod_rm_mode of its operand */
+  int32_t add_off;
+  int64_t add_arg;
+  size_t flags_end; /* up to here, ZF tells whether the cell at flags_off */
+  int32_t flags_off; /* is zero */
+} peephole_t;
+
+#define CELL_REGS 6
+
+/* tape cells held in registers over an innermost loop, the current cell always
+ * comes first */
+typedef struct {
+  uint8_t count;
+  int32_t off[CELL_REGS];
+} cell_regs_t;
+
 typedef struct {
   vec_t(uint8_t);
   ir_patch_t *patch;
+  compile_layout_t *layout;
+  peephole_t peephole;
+  cell_regs_t regs;
 } compile_ctx;
 
 typedef enum {
@@ -21,6 +72,8 @@ typedef enum {
  * use %ebp, but that makes encoding instructions a bit harder. e.g inc (%ebp)
  * needs 3 whereas only 2 are needed for other registers. */
 #define SP_REG REG_EDI
+/* points at the next free byte of the output buffer */
+#define OUT_REG REG_ESI
 
 typedef enum {
   REG_EAX = 0x00,
@@ -31,6 +84,15 @@ typedef enum {
   REG_EBP = 0x05,
   REG_ESI = 0x06,
   REG_EDI = 0x07, /* used as sp */
+  /* x86-64 only, they need a rex prefix */
+  REG_R8 = 0x08,
+  REG_R9 = 0x09,
+  REG_R10 = 0x0A,
+  REG_R11 = 0x0B,
+  REG_R12 = 0x0C,
+  REG_R13 = 0x0D,
+  REG_R14 = 0x0E,
+  REG_R15 = 0x0F,
 } reg_t;
 
 /* 32 bit linux syscalls */
@@ -38,6 +100,8 @@ typedef enum {
   SYS_EXIT = 0x01,
   SYS_READ = 0x03,
   SYS_WRITE = 0x04,
+  SYS_MPROTECT = 0x7D,
+  SYS_RT_SIGACTION = 0xAE,
 } syscall_t;
 
 typedef enum {
@@ -47,7 +111,9 @@ typedef enum {
   MODE_REG_DIRECT = 0x3
 } mod_rm_mode;
 
-#define mod_rm(mode, reg, rm) ((mode << 6) | (reg << 3) | rm)
+#define mod_rm(mode, reg, rm) (((mode) << 6) | ((reg) << 3) | (rm))
+#define sib(scale, index, base) (((scale) << 6) | ((index) << 3) | (base))
+#define rex(w, r, x, b) (0x40 | ((w) << 3) | ((r) << 2) | ((x) << 1) | (b))
 
 #define macro_count_args(...)                                                  \
   (sizeof((uint8_t[]){__VA_ARGS__}) / sizeof(uint8_t))
@@ -56,3 +122,5 @@ typedef enum {
   vec_pusharr(ctx, ((uint8_t[]){__VA_ARGS__}), macro_count_args(__VA_ARGS__))
 
 size_t ir_ctx_compile(compile_ctx *ctx, ir_ctx *ctx_ir);
+compile_result ir_compile_write_data(compile_ctx *ctx, uint32_t addr,
+                                     uint32_t length);
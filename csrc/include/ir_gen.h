@@ -15,11 +15,30 @@ typedef enum {
   IR_OP_WRITE = 0x4,       /* , */
   IR_OP_READ = 0x5,        /* . */
   IR_OP_SET = 0x6,         /* for statically determined expressions */
-  IR_OP_MAX = 0x7,
+  IR_OP_MUL = 0x7,         /* [->+<] : tape[sp + off] += arg * tape[sp] */
+  IR_OP_SCAN = 0x8,        /* [>] | [<] : move by arg until tape[sp] == 0 */
+  IR_OP_LOOP_ENTER = 0x9,  /* [ whose cell is known to be nonzero */
+  IR_OP_VADD = 0xA,        /* tape[sp + off + i] += byte i of arg, i < 8 */
+  IR_OP_VSET = 0xB,        /* tape[sp + off + i] = byte i of arg, i < 8 */
+  IR_OP_CLEAR = 0xC,       /* zero arg cells from tape[sp + off] on */
+  /* superinstructions, which only the interpreter makes. each one is the op
+   * it replaced fused with the op after it. */
+  IR_OP_TAPE_LOOP_END = 0x10,
+  IR_OP_TAPE_MUL = 0x11,
+  IR_OP_MUL_SET = 0x12,
+  IR_OP_SET_TAPE = 0x13,
+  IR_OP_CELL_TAPE = 0x14,
+  IR_OP_LOOP_START_TAPE = 0x15,
+  /* doubles as the mask used when dispatching, so keep it at 2^n - 1 */
+  IR_OP_MAX = 0x1F,
 } ir_op_kind_t;
 
+/* the eof convention of reads that leave the cell as it was */
+#define EOF_UNCHANGED INT32_MIN
+
 typedef struct {
   ir_op_kind_t kind;
+  int32_t off; /* offset from sp of the cell the op works on */
   int64_t arg;
 } ir_op_t;
 
@@ -28,13 +47,81 @@ typedef struct ir_patch {
   struct ir_patch *prev;
 } ir_patch_t;
 
+/* an op packed into 4 bytes: the kind, then the offset and the arg, both
+ * signed. an op whose offset or arg does not fit is escaped, with
+ * IR_CODE_ESCAPE set in its kind, and the 24 bits after the kind are the index
+ * of the op in full in the side table. ops keep their index either way, so
+ * loops can still be linked by how far apart they are. */
+typedef struct {
+  uint8_t kind;
+  int8_t off;
+  int16_t arg;
+} ir_code_t;
+
+#define IR_CODE_ESCAPE 0x20
+#define IR_CODE_SLOTS (1u << 24)
+
 typedef struct {
-  vec_t(ir_op_t);
-  ir_patch_t *patch;
+  vec_t(ir_code_t);
+  vec_t(ir_op_t) wide; /* the side table of escaped ops */
+  /* one past the innermost [ still waiting for its ], 0 for none. until then
+   * the arg of each one holds how far back the [ around it is, 0 for none. */
+  size_t open;
 } ir_ctx;
 
+static inline size_t ir_code_slot(ir_code_t code) {
+  return (uint8_t)code.off | (size_t)(uint16_t)code.arg << 8;
+}
+
+/* the op a word holds, knowing whether it is escaped */
+static inline ir_op_t ir_code_packed(ir_code_t code) {
+  return (ir_op_t){
+      .kind = code.kind & IR_OP_MAX, .off = code.off, .arg = code.arg};
+}
+
+static inline ir_op_t ir_code_escaped(ir_code_t code, const ir_op_t *wide) {
+  const ir_op_t *op = &wide[ir_code_slot(code)];
+  return (ir_op_t){
+      .kind = code.kind & IR_OP_MAX, .off = op->off, .arg = op->arg};
+}
+
+static inline ir_op_t ir_code_unpack(ir_code_t code, const ir_op_t *wide) {
+  if (__builtin_expect(code.kind & IR_CODE_ESCAPE, 0))
+    return ir_code_escaped(code, wide);
+  return ir_code_packed(code);
+}
+
+/* the op at i, unpacked */
+static inline ir_op_t ir_op_at(const ir_ctx *ctx, size_t i) {
+  return ir_code_unpack(ctx->data[i], ctx->wide.data);
+}
+
+static inline ir_op_kind_t ir_kind_at(const ir_ctx *ctx, size_t i) {
+  return ctx->data[i].kind & IR_OP_MAX;
+}
+
+/* the cells a program can get to, relative to the one it starts on. they are
+ * only known when every loop ends up where it started, and nothing moves by
+ * an amount worked out at run time. */
+typedef struct {
+  size_t balanced, unbalanced; /* loops that do and do not */
+  int known;
+  int64_t min, max; /* the first and last cell used */
+} ir_tape_range_t;
+
 void ir_ctx_free(ir_ctx *ctx);
-size_t ir_ctx_parse(ir_ctx *ctx, const char *src);
+void ir_op_put(ir_ctx *ctx, size_t i, ir_op_t op);
+void ir_op_push(ir_ctx *ctx, ir_op_t op);
+size_t ir_ctx_parse(ir_ctx *ctx, const char *src, size_t length);
+void ir_ctx_link_loops(ir_ctx *ctx);
+void ir_pass_mul_loops(ir_ctx *ctx, size_t cells);
+void ir_pass_scan_loops(ir_ctx *ctx);
+void ir_pass_fold_offsets(ir_ctx *ctx);
+void ir_pass_const_cells(ir_ctx *ctx, int cell_bits, size_t cells);
+void ir_pass_vector_cells(ir_ctx *ctx, int cell_bits, size_t cells);
+void ir_ctx_optimize(ir_ctx *ctx, int cell_bits, size_t cells);
+void ir_ctx_resume(ir_ctx *ctx, size_t ip, ir_ctx *code);
+ir_tape_range_t ir_ctx_tape_range(ir_ctx *ctx);
 void ir_ctx_dump_bf(ir_ctx *ctx);
 void ir_ctx_dump_ir(ir_ctx *ctx);
 
@@ -4,8 +4,21 @@
 #include "ir_gen.h"
 #include <stdint.h>
 
+/* the tape, cell_size bytes to a cell */
 typedef struct {
   vec_t(uint8_t);
+  int cell_size;
+  int32_t eof;    /* what a read stores at the end of input */
+  int tail_calls; /* run on the tail-call engine instead of computed goto */
 } interpret_ctx_t;
 
+/* how far running the program at compile time got */
+typedef struct {
+  interpret_ctx_t tape;
+  size_t sp;
+  size_t ip; /* the first op that did not run */
+  vec_t(uint8_t) output;
+} partial_eval_t;
+
 size_t ir_interpret(ir_ctx *ir_ctx, interpret_ctx_t *ctx);
+size_t ir_partial_eval(ir_ctx *ir_ctx, partial_eval_t *pe, uint64_t fuel);
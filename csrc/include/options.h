@@ -1,9 +1,18 @@
 #pragma once
 
+#include <stdint.h>
+
 typedef struct {
   char *input_name;
   char *output_name;
   int dump_ir;
+  uint64_t partial_eval; /* fuel for running the program at compile time */
+  int32_t eof;           /* what a read stores at the end of input */
+  int jit;
+  int x86_64;         /* compile to x86-64 instead of i386 */
+  int cell_bits;      /* 8, 16 or 32 */
+  uint64_t tape_size; /* cells on the tape, 0 to pick them for the program */
+  int tail_calls;     /* interpret with the tail-call engine */
 } options_t;
 
 int parse_options(options_t *options, int argc, char *const argv[]);
@@ -2,6 +2,7 @@
 #include "common.h"
 #include <elf.h>
 #include <stdint.h>
+#include <string.h>
 #include <unistd.h>
 
 #define PAGE_SIZE 4096
@@ -17,28 +18,34 @@
 typedef vec_t(uint8_t) bytes_t;
 typedef map_t(const char *) map_str_t;
 
-elf_gen_ctx elf_gen_ctx_init() {
+/* the headers are kept in their 64 bit form, and only narrowed down when
+ * writing out a 32 bit file */
+#define is_elf64(ctx) ((ctx)->elf_header.e_ident[EI_CLASS] == ELFCLASS64)
+#define elf_sizeof(ctx, type)                                                  \
+  (is_elf64(ctx) ? sizeof(Elf64_##type) : sizeof(Elf32_##type))
+
+elf_gen_ctx elf_gen_ctx_init(uint8_t elf_class, uint16_t machine) {
   elf_gen_ctx elf_ctx = {0};
-  elf_ctx.elf_header = (Elf32_Ehdr){
+  elf_ctx.elf_header = (Elf64_Ehdr){
       .e_ident =
           {
               [EI_MAG0] = ELFMAG0,
               [EI_MAG1] = ELFMAG1,
               [EI_MAG2] = ELFMAG2,
               [EI_MAG3] = ELFMAG3,
-              [EI_CLASS] = ELFCLASS32,
+              [EI_CLASS] = elf_class,
               [EI_DATA] = ELFDATA2LSB,
               [EI_VERSION] = EV_CURRENT,
               [EI_OSABI] = ELFOSABI_NONE,
           },
       .e_type = ET_EXEC,
-      .e_machine = EM_386,
+      .e_machine = machine,
       .e_version = EV_CURRENT,
       .e_entry = 0,
       .e_phoff = 0, /* updated in finalize_elf_ctx */
       .e_shoff = 0, /* updated in finalize_elf_ctx */
       .e_flags = 0,
-      .e_ehsize = sizeof(Elf32_Ehdr),
+      .e_ehsize = 0,    /* updated in finalize_elf_ctx */
       .e_phentsize = 0, /* updated in finalize_elf_ctx */
       .e_phnum = 0,     /* updated in finalize_elf_ctx */
       .e_shentsize = 0, /* updated in finalize_elf_ctx */
@@ -66,14 +73,14 @@ void elf_gen_ctx_free(elf_gen_ctx *ctx) {
 }
 
 program_t *gen_program_header(elf_gen_ctx *ctx, const char *name,
-                              Elf32_Phdr header) {
+                              Elf64_Phdr header) {
   header.p_align = PAGE_SIZE;
   map_set(&ctx->segments, name, ((program_t){.header = header}));
   return map_get(&ctx->segments, name);
 }
 
 section_t *gen_section_header(elf_gen_ctx *ctx, const char *name,
-                              Elf32_Shdr header) {
+                              Elf64_Shdr header) {
   header.sh_addralign = PAGE_SIZE;
   map_set(&ctx->sections, name, ((section_t){.header = header}));
   return map_get(&ctx->sections, name);
@@ -100,15 +107,17 @@ void fix_header_offsets(elf_gen_ctx *ctx) {
   const char *name = NULL;
   /* calculate offsets for program segments */
   map_iter_t iter = map_iter(&ctx->segments);
-  uint64_t offset = align_to(sizeof(ctx->elf_header) +
-                                 ctx->segments.count * sizeof(Elf32_Phdr),
+  uint64_t offset = align_to(elf_sizeof(ctx, Ehdr) +
+                                 ctx->segments.count * elf_sizeof(ctx, Phdr),
                              PAGE_SIZE);
   while ((name = map_next(&ctx->segments, &iter))) {
     program_t *program = map_get(&ctx->segments, name);
     uint64_t length = program->length;
     if (program->length && program->capacity) {
       program->header.p_filesz = length;
-      program->header.p_memsz = length;
+      /* anything past the data is zero filled, like .bss */
+      if (program->header.p_memsz < length)
+        program->header.p_memsz = length;
       program->header.p_offset = offset;
       /* TODO: automatically allocate these virutal adresses */
       /* program->header.p_vaddr = 0; */
@@ -120,7 +129,7 @@ void fix_header_offsets(elf_gen_ctx *ctx) {
   }
 
   ctx->sections.shstrtab =
-      (section_t){.header = (Elf32_Shdr){.sh_name = 1,
+      (section_t){.header = (Elf64_Shdr){.sh_name = 1,
                                          .sh_type = SHT_STRTAB,
                                          .sh_addralign = PAGE_SIZE,
                                          .sh_flags = SHF_STRINGS}};
@@ -163,17 +172,83 @@ void fix_header_offsets(elf_gen_ctx *ctx) {
 void finalize_elf_ctx(elf_gen_ctx *ctx) {
   fix_header_offsets(ctx);
 
+  ctx->elf_header.e_ehsize = elf_sizeof(ctx, Ehdr);
   if (ctx->segments.count) {
     ctx->elf_header.e_phnum = ctx->segments.count;
-    ctx->elf_header.e_phentsize = sizeof(Elf32_Phdr);
-    ctx->elf_header.e_phoff = sizeof(Elf32_Ehdr);
+    ctx->elf_header.e_phentsize = elf_sizeof(ctx, Phdr);
+    ctx->elf_header.e_phoff = elf_sizeof(ctx, Ehdr);
   }
 
   /* add 1 to account for NULL section */
   ctx->elf_header.e_shnum = ctx->sections.count + 1;
-  ctx->elf_header.e_shentsize = sizeof(Elf32_Shdr);
+  ctx->elf_header.e_shentsize = elf_sizeof(ctx, Shdr);
   ctx->elf_header.e_shoff =
-      sizeof(Elf32_Ehdr) + ctx->segments.count * sizeof(Elf32_Phdr);
+      elf_sizeof(ctx, Ehdr) + ctx->segments.count * elf_sizeof(ctx, Phdr);
+}
+
+static void write_elf_header(FILE *fp, elf_gen_ctx *ctx) {
+  const Elf64_Ehdr *h = &ctx->elf_header;
+  if (is_elf64(ctx)) {
+    fwrite(h, sizeof(*h), 1, fp);
+    return;
+  }
+  Elf32_Ehdr header = {
+      .e_type = h->e_type,
+      .e_machine = h->e_machine,
+      .e_version = h->e_version,
+      .e_entry = h->e_entry,
+      .e_phoff = h->e_phoff,
+      .e_shoff = h->e_shoff,
+      .e_flags = h->e_flags,
+      .e_ehsize = h->e_ehsize,
+      .e_phentsize = h->e_phentsize,
+      .e_phnum = h->e_phnum,
+      .e_shentsize = h->e_shentsize,
+      .e_shnum = h->e_shnum,
+      .e_shstrndx = h->e_shstrndx,
+  };
+  memcpy(header.e_ident, h->e_ident, EI_NIDENT);
+  fwrite(&header, sizeof(header), 1, fp);
+}
+
+static void write_program_header(FILE *fp, elf_gen_ctx *ctx,
+                                 const Elf64_Phdr *h) {
+  if (is_elf64(ctx)) {
+    fwrite(h, sizeof(*h), 1, fp);
+    return;
+  }
+  Elf32_Phdr header = {
+      .p_type = h->p_type,
+      .p_offset = h->p_offset,
+      .p_vaddr = h->p_vaddr,
+      .p_paddr = h->p_paddr,
+      .p_filesz = h->p_filesz,
+      .p_memsz = h->p_memsz,
+      .p_flags = h->p_flags,
+      .p_align = h->p_align,
+  };
+  fwrite(&header, sizeof(header), 1, fp);
+}
+
+static void write_section_header(FILE *fp, elf_gen_ctx *ctx,
+                                 const Elf64_Shdr *h) {
+  if (is_elf64(ctx)) {
+    fwrite(h, sizeof(*h), 1, fp);
+    return;
+  }
+  Elf32_Shdr header = {
+      .sh_name = h->sh_name,
+      .sh_type = h->sh_type,
+      .sh_flags = h->sh_flags,
+      .sh_addr = h->sh_addr,
+      .sh_offset = h->sh_offset,
+      .sh_size = h->sh_size,
+      .sh_link = h->sh_link,
+      .sh_info = h->sh_info,
+      .sh_addralign = h->sh_addralign,
+      .sh_entsize = h->sh_entsize,
+  };
+  fwrite(&header, sizeof(header), 1, fp);
 }
 
 void gen_elf_file(FILE *fp, elf_gen_ctx *ctx) {
@@ -181,24 +256,24 @@ void gen_elf_file(FILE *fp, elf_gen_ctx *ctx) {
   finalize_elf_ctx(ctx);
 
   /* write the ELF header */
-  fwrite(&ctx->elf_header, sizeof(ctx->elf_header), 1, fp);
+  write_elf_header(fp, ctx);
 
   /* write the program headers */
   const char *name = NULL;
   map_iter_t iter = map_iter(&ctx->segments);
   while ((name = map_next(&ctx->segments, &iter))) {
     program_t *program = map_get(&ctx->segments, name);
-    fwrite(&program->header, sizeof(program->header), 1, fp);
+    write_program_header(fp, ctx, &program->header);
   }
 
   /* write NULL section */
-  fwrite(&(Elf32_Shdr){.sh_type = SHT_NULL}, sizeof(Elf32_Shdr), 1, fp);
+  write_section_header(fp, ctx, &(Elf64_Shdr){.sh_type = SHT_NULL});
 
   /* write the section headers */
   iter = map_iter(&ctx->sections);
   while ((name = map_next(&ctx->sections, &iter))) {
     section_t *section = map_get(&ctx->sections, name);
-    fwrite(&section->header, sizeof(section->header), 1, fp);
+    write_section_header(fp, ctx, &section->header);
   }
 
   /* write the actual segments */
@@ -1,5 +1,6 @@
 #include "ir_compile.h"
 #include "common.h"
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdint.h>
 #include <string.h>
@@ -26,28 +27,166 @@ static const char *mod_rm_names[] = {
 };
 #endif
 
+/* the tape and output pointers are 64 bit in long mode, so arithmetic on them
+ * needs rex.w */
+static inline void emit_rex_w(compile_ctx *ctx) {
+  if (ctx->layout->target & TARGET_X86_64)
+    ctx_push_code(ctx, rex(1, 0, 0, 0));
+}
+
+/* mov %src, %dst for any two of the 16 x86-64 registers */
+static inline void emit_mov_reg64(compile_ctx *ctx, reg_t dst, reg_t src) {
+  ctx_push_code(ctx, rex(1, src >> 3, 0, dst >> 3), 0x89,
+                mod_rm(MODE_REG_DIRECT, src & 7, dst & 7));
+}
+
+/* emits the mod r/m byte addressing [%SP_REG + off], using the shortest
+ * displacement that fits */
+static inline void emit_sp_disp(compile_ctx *ctx, uint8_t reg, int32_t off) {
+  if (off == 0) {
+    ctx_push_code(ctx, mod_rm(MODE_REG_INDIRECT, reg, SP_REG));
+  } else if (off >= INT8_MIN && off <= INT8_MAX) {
+    /* [%SP_REG + disp8] */
+    ctx_push_code(ctx, mod_rm(MODE_SIB_1, reg, SP_REG), (int8_t)off);
+  } else {
+    /* [%SP_REG + disp32] */
+    ctx_push_code(ctx, mod_rm(MODE_SIB_2, reg, SP_REG));
+    vec_push_as_bytes(ctx, &off);
+  }
+}
+
+/* the same for the cell off cells away */
+static inline void emit_sp_operand(compile_ctx *ctx, uint8_t reg,
+                                   int32_t off) {
+  emit_sp_disp(ctx, reg, off * ctx->layout->cell_size);
+}
+
+/* emits the operand size prefix for doing what the byte opcode does to a whole
+ * cell, returning the opcode to use. movzx loads of 32 bit cells become plain
+ * movs. */
+static inline uint16_t emit_cell_size(compile_ctx *ctx, uint16_t opcode) {
+  uint8_t size = ctx->layout->cell_size;
+  if (size == 1)
+    return opcode;
+  if (opcode == 0x0FB6)
+    return size == 2 ? 0x0FB7 : 0x8B;
+  if (size == 2)
+    ctx_push_code(ctx, 0x66);
+  /* the immediate of 0x80 turns into a sign extended imm8, the others just
+   * get their low bit set */
+  return opcode == 0x80 ? 0x83 : opcode | 1;
+}
+
+/* pushes the low bytes of value, as many as there are in a cell */
+static inline void emit_cell_imm(compile_ctx *ctx, int64_t value) {
+  uint32_t imm = value;
+  vec_pusharr(ctx, (uint8_t *)&imm, ctx->layout->cell_size);
+}
+
+/* value wrapped around to what adding it does to a cell, keeping its sign */
+static inline int64_t cell_wrap(compile_ctx *ctx, int64_t value) {
+  switch (ctx->layout->cell_size) {
+  case 1:
+    return value % 0x100;
+  case 2:
+    return value % 0x10000;
+  default:
+    return (int32_t)value;
+  }
+}
+
+/* the registers cells can be kept in, or the low byte or word of them. %eax
+ * and %ecx are scratch, %esi and %edi are taken. the high bytes would have to
+ * be merged with the low ones on every change, so they are left alone. x86-64
+ * has a few more, which the io routines clobber along with the rest. */
+static const uint8_t cell_reg[CELL_REGS] = {REG_EBX, REG_EDX, REG_R8,
+                                            REG_R9,  REG_R10, REG_R11};
+
+static inline uint8_t cell_reg_count(compile_ctx *ctx) {
+  return ctx->layout->target & TARGET_X86_64 ? CELL_REGS : 2;
+}
+
+/* emits the byte opcode (two bytes if it does not fit one) in the form for the
+ * size of a cell, with a mod r/m addressing the value of the cell at off,
+ * which may be held in a register instead */
+static inline void emit_cell_insn(compile_ctx *ctx, uint16_t opcode,
+                                  uint8_t reg, int32_t off) {
+  uint8_t i = 0;
+  while (i < ctx->regs.count && ctx->regs.off[i] != off)
+    i++;
+  opcode = emit_cell_size(ctx, opcode);
+  if (i < ctx->regs.count && cell_reg[i] > 7)
+    ctx_push_code(ctx, rex(0, 0, 0, 1));
+  if (opcode > 0xFF)
+    ctx_push_code(ctx, opcode >> 8);
+  ctx_push_code(ctx, opcode & 0xFF);
+  if (i < ctx->regs.count)
+    ctx_push_code(ctx, mod_rm(MODE_REG_DIRECT, reg, cell_reg[i] & 7));
+  else
+    emit_sp_operand(ctx, reg, off);
+}
+
 /* use inc for registers, add for mem locs. add is 1 uop less. */
 static inline compile_result emit_add_sub(compile_ctx *ctx, mod_rm_mode mode,
                                           ir_op_t op) {
-  if (op.arg == 0)
+  /* fold into an add/sub on the same operand right in front of this one */
+  peephole_t *last = &ctx->peephole;
+  if (last->add_end && last->add_end == ctx->length &&
+      last->add_mode == (int)mode &&
+      (mode == MODE_REG_DIRECT || last->add_off == op.off)) {
+    ctx->length = last->add_at;
+    last->flags_end = 0;
+    op.arg += last->add_arg;
+  }
+  last->add_end = 0;
+  if (mode == MODE_REG_INDIRECT)
+    op.arg = cell_wrap(ctx, op.arg);
+
+  /* moves of the tape pointer are counted in cells, it moves by bytes */
+  int64_t arg = op.arg;
+  if (mode == MODE_REG_DIRECT)
+    arg *= ctx->layout->cell_size;
+  if (arg == 0)
     return COMPILE_OK;
-  if (op.arg > INT32_MAX || op.arg < INT32_MIN) {
+  if (arg > INT32_MAX || arg < INT32_MIN) {
     return COMPILE_OPERAND_SIZE;
   }
-  switch (op.arg) {
+  size_t at = ctx->length;
+
+  if (mode == MODE_REG_DIRECT && last->flags_end &&
+      last->flags_end == ctx->length) {
+    /* lea off(%SP_REG), %SP_REG moves without touching the flags, so they
+     * keep describing the cell that was changed last */
+    emit_rex_w(ctx);
+    ctx_push_code(ctx, 0x8D);
+    emit_sp_operand(ctx, SP_REG, op.arg);
+    last->flags_end = ctx->length;
+    last->flags_off -= op.arg;
+    return COMPILE_OK;
+  }
+  switch (arg) {
   case 1:
     /* inc %SP_REG */
-    if (mode == MODE_REG_DIRECT)
+    if (mode == MODE_REG_DIRECT && (ctx->layout->target & TARGET_X86_64)) {
+      /* the short form is a rex prefix in long mode */
+      emit_rex_w(ctx);
+      ctx_push_code(ctx, 0xFF, mod_rm(MODE_REG_DIRECT, 0, SP_REG));
+    } else if (mode == MODE_REG_DIRECT) {
       ctx_push_code(ctx, 0x40 + SP_REG);
-    else
-      ctx_push_code(ctx, 0xFE, mod_rm(mode, 0, SP_REG));
+    } else {
+      emit_cell_insn(ctx, 0xFE, 0, op.off);
+    }
     break;
   case -1:
     /* dec %SP_REG */
-    if (mode == MODE_REG_DIRECT)
+    if (mode == MODE_REG_DIRECT && (ctx->layout->target & TARGET_X86_64)) {
+      emit_rex_w(ctx);
+      ctx_push_code(ctx, 0xFF, mod_rm(MODE_REG_DIRECT, 1, SP_REG));
+    } else if (mode == MODE_REG_DIRECT) {
       ctx_push_code(ctx, 0x48 + SP_REG);
-    else
-      ctx_push_code(ctx, 0xFE, mod_rm(mode, 1, SP_REG));
+    } else {
+      emit_cell_insn(ctx, 0xFE, 1, op.off);
+    }
     break;
   default:
     /* for indirect adressing (the register contains the memory address),
@@ -60,8 +199,9 @@ static inline compile_result emit_add_sub(compile_ctx *ctx, mod_rm_mode mode,
         /* we want wrap around at 0xff so we can perform the modulus here */
         /* op.arg &= 0xff; */
         if (op.arg <= INT8_MAX) {
-          /* add (%SP_REG:8), imm8 */
-          ctx_push_code(ctx, 0x80, mod_rm(mode, 0, SP_REG), (int8_t)op.arg);
+          /* add (%SP_REG + off:8), imm8 */
+          emit_cell_insn(ctx, 0x80, 0, op.off);
+          ctx_push_code(ctx, (int8_t)op.arg);
         } else {
           /* to prevent an overflow from happening, we load the value we want
            * into %eax, then add %ax to (%SP_REG). this allows us to do addition
@@ -72,8 +212,8 @@ static inline compile_result emit_add_sub(compile_ctx *ctx, mod_rm_mode mode,
           ctx_push_code(ctx, 0xC7, mod_rm(MODE_REG_DIRECT, 0, REG_EAX));
           vec_push_as_bytes(ctx, &arg);
 
-          /* add (%SP_REG:8), %ax */
-          ctx_push_code(ctx, 0x00, mod_rm(mode, REG_EAX, SP_REG));
+          /* add (%SP_REG + off:8), %ax */
+          emit_cell_insn(ctx, 0x00, REG_EAX, op.off);
         }
       } else {
         /* we cannot `sub 128` because 128 is to big to fit as a s8 operand.
@@ -81,8 +221,9 @@ static inline compile_result emit_add_sub(compile_ctx *ctx, mod_rm_mode mode,
          * state, since we don't use them anyways. however, for simplicity, i
          * will simply just promote them to "large" subtractions */
         if (-op.arg <= INT8_MAX) {
-          /* sub (%SP_REG:8), imm8 */
-          ctx_push_code(ctx, 0x80, mod_rm(mode, 5, SP_REG), (int8_t)(-op.arg));
+          /* sub (%SP_REG + off:8), imm8 */
+          emit_cell_insn(ctx, 0x80, 5, op.off);
+          ctx_push_code(ctx, (int8_t)(-op.arg));
         } else {
           int32_t arg = -op.arg;
 
@@ -90,124 +231,495 @@ static inline compile_result emit_add_sub(compile_ctx *ctx, mod_rm_mode mode,
           ctx_push_code(ctx, 0xC7, mod_rm(MODE_REG_DIRECT, 0, REG_EAX));
           vec_push_as_bytes(ctx, &arg);
 
-          /* sub (%SP_REG:8), %ax */
-          ctx_push_code(ctx, 0x28, mod_rm(mode, REG_EAX, SP_REG));
+          /* sub (%SP_REG + off:8), %ax */
+          emit_cell_insn(ctx, 0x28, REG_EAX, op.off);
         }
       }
     } else if (mode == MODE_REG_DIRECT) {
-      if (op.arg > 0) {
-        if (op.arg <= INT8_MAX) {
+      emit_rex_w(ctx);
+      if (arg > 0) {
+        if (arg <= INT8_MAX) {
           /* add %SP_REG:(r16/r32), imm8 */
-          ctx_push_code(ctx, 0x83, mod_rm(mode, 0, SP_REG), (int8_t)op.arg);
+          ctx_push_code(ctx, 0x83, mod_rm(mode, 0, SP_REG), (int8_t)arg);
         } else {
-          int32_t arg = (int32_t)op.arg;
+          int32_t imm = (int32_t)arg;
           /* add %SP_REG:(r16/r32), imm16/imm32 */
           ctx_push_code(ctx, 0x81, mod_rm(mode, 0, SP_REG));
-          vec_push_as_bytes(ctx, &arg);
+          vec_push_as_bytes(ctx, &imm);
         }
       } else {
-        if (-op.arg <= INT8_MAX) {
+        if (-arg <= INT8_MAX) {
           /* sub %SP_REG:(r16/r32), imm8 */
-          ctx_push_code(ctx, 0x83, mod_rm(mode, 5, SP_REG), (int8_t)(-op.arg));
+          ctx_push_code(ctx, 0x83, mod_rm(mode, 5, SP_REG), (int8_t)(-arg));
         } else {
-          int32_t arg = -op.arg;
+          int32_t imm = -arg;
           /* sub %SP_REG:(r16/r32), imm16/imm32 */
           ctx_push_code(ctx, 0x81, mod_rm(mode, 5, SP_REG));
-          vec_push_as_bytes(ctx, &arg);
+          vec_push_as_bytes(ctx, &imm);
         }
       }
     } else {
       return COMPILE_ILLEGAL_STATE;
     }
   }
-
-  /* TODO: check the tape pointer is legal after a move */
-#if 0
-  /* pop %eax: pop bss location from stack into eax */
-  ctx_push_code(ctx, 0x8F, mod_rm(MODE_REG_DIRECT, 0, REG_EAX));
-
-  if (sp >= ctx->capacity) {
-      sp -= ctx->capacity;
-    } else if (sp < 0) {
-      sp += ctx->capacity;
-    }
-
-  if (op.arg > 0) {
-    /* check for tape overflow */
-  } else {
-    /* check for tape underflow */
+  last->add_at = at;
+  last->add_end = ctx->length;
+  last->add_mode = mode;
+  last->add_off = op.off;
+  last->add_arg = op.arg;
+  if (mode == MODE_REG_INDIRECT) {
+    last->flags_end = ctx->length;
+    last->flags_off = op.off;
   }
-
-  /* push %eax */
-  ctx_push_code(ctx, 0xFF, mod_rm(MODE_REG_DIRECT, 6, REG_EAX));
-#endif
   return COMPILE_OK;
 }
 
 static inline compile_result emit_code_tape(compile_ctx *ctx, ir_ctx *ctx_ir,
                                             size_t idx) {
-  return emit_add_sub(ctx, MODE_REG_DIRECT, ctx_ir->data[idx]);
+  return emit_add_sub(ctx, MODE_REG_DIRECT, ir_op_at(ctx_ir, idx));
 }
 
 static inline compile_result emit_code_cell(compile_ctx *ctx, ir_ctx *ctx_ir,
                                             size_t idx) {
-  return emit_add_sub(ctx, MODE_REG_INDIRECT, ctx_ir->data[idx]);
+  return emit_add_sub(ctx, MODE_REG_INDIRECT, ir_op_at(ctx_ir, idx));
 }
 
 #define ctx_patch_code(ctx, idx, ...)                                          \
   vec_insertarr(ctx, idx, ((uint8_t[]){__VA_ARGS__}),                          \
                 macro_count_args(__VA_ARGS__))
 
-static inline compile_result emit_code_loop_start(compile_ctx *ctx, ir_ctx *ir,
-                                                  size_t size) {
-  unused(ir);
+/* a loop's conditional jump, or a call to an outlined loop. jumps are emitted
+ * as a jcc rel32 placeholder and get their final encoding once the layout of
+ * the whole program is known. */
+typedef struct {
+  size_t at;     /* offset of the placeholder */
+  size_t target; /* offset it jumps to, the routine for calls */
+  uint8_t cc;    /* condition code, 0x4 for je and 0x5 for jne, or JUMP_CALL */
+  uint8_t is_long;
+} jump_t;
+
+typedef vec_t(jump_t) jump_vec_t;
+
+#define JUMP_LONG 6
+#define JUMP_SHORT 2
+#define JUMP_CALL 0xFF
+#define JUMP_CALL_LENGTH 5
+
+static inline size_t jump_placeholder(jump_t *jump) {
+  return jump->cc == JUMP_CALL ? JUMP_CALL_LENGTH : JUMP_LONG;
+}
+
+static inline size_t jump_length(jump_t *jump) {
+  if (jump->cc == JUMP_CALL)
+    return JUMP_CALL_LENGTH;
+  return jump->is_long ? JUMP_LONG : JUMP_SHORT;
+}
+
+/* cmp (%SP_REG), $0; j<cc> placeholder */
+static inline size_t emit_loop_jump(compile_ctx *ctx, jump_vec_t *jumps,
+                                    uint8_t cc, size_t target) {
+  /* an add/sub on the current cell just before already set ZF */
+  peephole_t *last = &ctx->peephole;
+  if (!last->flags_end || last->flags_end != ctx->length ||
+      last->flags_off != 0) {
+    emit_cell_insn(ctx, 0x80, 0x7, 0);
+    ctx_push_code(ctx, 0x0);
+  }
+  vec_push(jumps, ((jump_t){.at = ctx->length, .target = target, .cc = cc}));
+  ctx_push_code(ctx, 0x0F, 0x80 | cc, 0x0, 0x0, 0x0, 0x0);
+  return jumps->length - 1;
+}
+
+/* where offset ends up in the final code. prefix holds how much the jumps in
+ * front of each jump have shrunk. */
+static inline int64_t jump_offset(jump_vec_t *jumps, size_t *prefix,
+                                  size_t offset) {
+  /* the number of jumps placed before offset */
+  size_t lo = 0, hi = jumps->length;
+  while (lo < hi) {
+    size_t mid = (lo + hi) / 2;
+    if (jumps->data[mid].at < offset)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return offset - prefix[lo];
+}
+
+static inline int64_t jump_disp(jump_vec_t *jumps, size_t *prefix,
+                                jump_t *jump) {
+  int64_t at = jump_offset(jumps, prefix, jump->at);
+  int64_t target = jump_offset(jumps, prefix, jump->target);
+  return target - at - jump_length(jump);
+}
+
+/* every jump starts out short, and the ones that cannot reach are made long.
+ * that only ever pushes code further apart, so this is repeated until nothing
+ * changes, then the code is rewritten with the final encodings. */
+static void relax_jumps(compile_ctx *ctx, jump_vec_t *jumps) {
+  size_t *prefix = calloc(jumps->length + 1, sizeof(*prefix));
+  for (int changed = 1; changed;) {
+    changed = 0;
+    for (size_t i = 0; i < jumps->length; i++) {
+      jump_t *jump = &jumps->data[i];
+      prefix[i + 1] = prefix[i] + jump_placeholder(jump) - jump_length(jump);
+    }
+    vec_for(jumps, jump, i) {
+      jump_t *jump = &jumps->data[iter.i];
+      int64_t disp = jump_disp(jumps, prefix, jump);
+      if (!jump->is_long && (disp < INT8_MIN || disp > INT8_MAX)) {
+        jump->is_long = 1;
+        changed = 1;
+      }
+    }
+  }
+
+  compile_ctx code = {.layout = ctx->layout};
+  vec_reserve(&code, ctx->length);
+  size_t from = 0;
+  vec_for(jumps, jump, i) {
+    jump_t *jump = &jumps->data[iter.i];
+    size_t count = jump->at - from;
+    vec_pusharr(&code, ctx->data + from, count);
+    from = jump->at + jump_placeholder(jump);
+    int32_t disp = jump_disp(jumps, prefix, jump);
+    if (jump->cc == JUMP_CALL) {
+      /* call rel32 */
+      ctx_push_code(&code, 0xE8);
+      vec_push_as_bytes(&code, &disp);
+    } else if (jump->is_long) {
+      /* j<cc> rel32 */
+      ctx_push_code(&code, 0x0F, 0x80 | jump->cc);
+      vec_push_as_bytes(&code, &disp);
+    } else {
+      /* j<cc> rel8 */
+      ctx_push_code(&code, 0x70 | jump->cc, (int8_t)disp);
+    }
+  }
+  size_t count = ctx->length - from;
+  vec_pusharr(&code, ctx->data + from, count);
+  free(prefix);
+
+  ctx->length = 0;
+  vec_extend(ctx, &code);
+  vec_deinit(&code);
+}
 
-  /* cmp (%SP_REG), $0 */
-  ctx_push_code(ctx, 0x80, mod_rm(MODE_REG_INDIRECT, 0x7, SP_REG), 0x0);
+static inline compile_result emit_code_set(compile_ctx *ctx, ir_ctx *ctx_ir,
+                                           size_t idx) {
+  ir_op_t op = ir_op_at(ctx_ir, idx);
+  /* mov (%SP_REG + off:8), imm8/imm16/imm32 */
+  emit_cell_insn(ctx, 0xC6, 0, op.off);
+  emit_cell_imm(ctx, op.arg);
+  return COMPILE_OK;
+}
 
-  /* check if we can do a short jump (accounting for 2 byte jump) */
-  if (size + 2 <= INT8_MAX) {
-    /* je imm8 (start of loop) */
-    ctx_push_code(ctx, 0x74, (int8_t)(size));
+/* tape[sp + off] += factor * %eax */
+static inline void emit_mul_add(compile_ctx *ctx, ir_op_t op) {
+  /* only the low bits of the factor matter, as many as there are in a cell */
+  int64_t factor = cell_wrap(ctx, op.arg);
+  int64_t magnitude = factor < 0 ? -factor : factor;
+  uint8_t add_sub = factor < 0 ? 0x28 : 0x00;
+  uint8_t scale = 0;
+
+  switch (magnitude) {
+  case 0:
+    return;
+  case 1:
+    /* add/sub (%SP_REG + off), %al */
+    emit_cell_insn(ctx, add_sub, REG_EAX, op.off);
+    return;
+  case 9:
+    scale++;
+    /* fall through */
+  case 5:
+    scale++;
+    /* fall through */
+  case 3:
+    scale++;
+    /* fall through */
+  case 2:
+    /* lea %ecx, (%eax, %eax, scale) */
+    ctx_push_code(ctx, 0x8D, mod_rm(MODE_REG_INDIRECT, REG_ECX, REG_ESP),
+                  sib(scale, REG_EAX, REG_EAX));
+    break;
+  default:
+    if (magnitude <= INT8_MAX || ctx->layout->cell_size == 1) {
+      /* imul %ecx, %eax, imm8, the sign extension of which only reaches past
+       * the low byte */
+      ctx_push_code(ctx, 0x6B, mod_rm(MODE_REG_DIRECT, REG_ECX, REG_EAX),
+                    (uint8_t)magnitude);
+    } else {
+      /* imul %ecx, %eax, imm32 */
+      uint32_t imm = magnitude;
+      ctx_push_code(ctx, 0x69, mod_rm(MODE_REG_DIRECT, REG_ECX, REG_EAX));
+      vec_push_as_bytes(ctx, &imm);
+    }
+    break;
+  }
+
+  /* add/sub (%SP_REG + off), %cl */
+  emit_cell_insn(ctx, add_sub, REG_ECX, op.off);
+}
+
+/* a run of muls stands in for a loop, so the first one emits the whole run
+ * behind the loop's test. the targets may lie off the tape when the loop would
+ * never have run. */
+static inline compile_result emit_code_mul(compile_ctx *ctx, ir_ctx *ctx_ir,
+                                           size_t idx) {
+  if (idx > 0 && ir_kind_at(ctx_ir, idx - 1) == IR_OP_MUL)
+    return COMPILE_OK;
+
+  compile_ctx body = {.layout = ctx->layout, .regs = ctx->regs};
+  for (size_t i = idx; ir_kind_at(ctx_ir, i) == IR_OP_MUL; i++)
+    emit_mul_add(&body, ir_op_at(ctx_ir, i));
+
+  /* movzx %eax, (%SP_REG:8/16) or mov %eax, (%SP_REG:32) */
+  emit_cell_insn(ctx, 0x0FB6, REG_EAX, 0);
+  /* test %eax, %eax */
+  ctx_push_code(ctx, 0x85, mod_rm(MODE_REG_DIRECT, REG_EAX, REG_EAX));
+  if (body.length <= INT8_MAX) {
+    /* je imm8 */
+    ctx_push_code(ctx, 0x74, (int8_t)body.length);
   } else {
-    /* je imm16/imm32 (start of loop) */
-    ctx_push_code(ctx, 0x0F, 0x84); /* 0x0F is a prefix byte */
-    int arg = (int32_t)(size);
+    /* je imm32 */
+    ctx_push_code(ctx, 0x0F, 0x84);
+    int32_t arg = (int32_t)body.length;
     vec_push_as_bytes(ctx, &arg);
   }
+  vec_extend(ctx, &body);
+  vec_deinit(&body);
+  return COMPILE_OK;
+}
+
+/* leaves the 8 bytes of lanes on top of the stack */
+static inline void emit_push_lanes(compile_ctx *ctx, uint64_t lanes) {
+  if (ctx->layout->target & TARGET_X86_64) {
+    /* mov %rax, imm64; push %rax */
+    ctx_push_code(ctx, rex(1, 0, 0, 0), 0xB8 + REG_EAX);
+    vec_push_as_bytes(ctx, &lanes);
+    ctx_push_code(ctx, 0x50 + REG_EAX);
+    return;
+  }
+  uint32_t high = lanes >> 32, low = (uint32_t)lanes;
+  /* push imm32; push imm32 */
+  ctx_push_code(ctx, 0x68);
+  vec_push_as_bytes(ctx, &high);
+  ctx_push_code(ctx, 0x68);
+  vec_push_as_bytes(ctx, &low);
+}
+
+/* a chain of vadds on neighbouring cells is emitted by its first op, two at a
+ * time as a single 16 byte add. the lanes get into %xmm1 by way of the
+ * stack. */
+static inline compile_result emit_code_vadd(compile_ctx *ctx, ir_ctx *ctx_ir,
+                                            size_t idx) {
+#define ops(i) ir_op_at(ctx_ir, i)
+  if (idx > 0 && ops(idx - 1).kind == IR_OP_VADD &&
+      ops(idx - 1).off == ops(idx).off - 8)
+    return COMPILE_OK;
+
+  for (size_t i = idx; ops(i).kind == IR_OP_VADD &&
+                       (i == idx || ops(i).off == ops(i - 1).off + 8);) {
+    ir_op_t op = ops(i++);
+    int wide = ops(i).kind == IR_OP_VADD && ops(i).off == op.off + 8;
+    if (wide)
+      emit_push_lanes(ctx, ops(i++).arg);
+    emit_push_lanes(ctx, op.arg);
+    /* movdqu/movq %xmm1, (%esp) */
+    ctx_push_code(ctx, 0xF3, 0x0F, wide ? 0x6F : 0x7E,
+                  mod_rm(MODE_REG_INDIRECT, 1, REG_ESP),
+                  sib(0, REG_ESP, REG_ESP));
+    /* add %esp, 16/8 */
+    emit_rex_w(ctx);
+    ctx_push_code(ctx, 0x83, mod_rm(MODE_REG_DIRECT, 0, REG_ESP),
+                  wide ? 16 : 8);
+    /* movdqu/movq %xmm0, (%SP_REG + off) */
+    ctx_push_code(ctx, 0xF3, 0x0F, wide ? 0x6F : 0x7E);
+    emit_sp_operand(ctx, 0, op.off);
+    /* paddb %xmm0, %xmm1 */
+    ctx_push_code(ctx, 0x66, 0x0F, 0xFC, mod_rm(MODE_REG_DIRECT, 0, 1));
+    /* movdqu/movq (%SP_REG + off), %xmm0 */
+    if (wide)
+      ctx_push_code(ctx, 0xF3, 0x0F, 0x7F);
+    else
+      ctx_push_code(ctx, 0x66, 0x0F, 0xD6);
+    emit_sp_operand(ctx, 0, op.off);
+  }
+#undef ops
+  return COMPILE_OK;
+}
 
+static inline compile_result emit_code_vset(compile_ctx *ctx, ir_ctx *ctx_ir,
+                                            size_t idx) {
+  ir_op_t op = ir_op_at(ctx_ir, idx);
+  for (int half = 0; half < 2; half++) {
+    uint32_t lanes = (uint64_t)op.arg >> (32 * half);
+    /* movl (%SP_REG + off), imm32 */
+    ctx_push_code(ctx, 0xC7);
+    emit_sp_operand(ctx, 0, op.off + 4 * half);
+    vec_push_as_bytes(ctx, &lanes);
+  }
   return COMPILE_OK;
 }
 
-static inline compile_result emit_code_loop_end(compile_ctx *ctx, ir_ctx *ir,
-                                                size_t idx) {
-  unused(ir);
-  unused(idx);
+/* clears up to this many bytes with 16 byte stores, rep stosb beyond */
+#define CLEAR_MAX_STORED 0x80
+
+static inline compile_result emit_code_clear(compile_ctx *ctx, ir_ctx *ctx_ir,
+                                             size_t idx) {
+  ir_op_t op = ir_op_at(ctx_ir, idx);
+  uint8_t size = ctx->layout->cell_size;
+  if (op.arg > INT32_MAX / size || op.off + op.arg > INT32_MAX / size)
+    return COMPILE_OPERAND_SIZE;
+  int32_t count = op.arg * size, from = op.off * size;
 
-  /* cmp (%SP_REG), $0 */
-  ctx_push_code(ctx, 0x80, mod_rm(MODE_REG_INDIRECT, 0x7, SP_REG), 0x0);
+  if (count <= CLEAR_MAX_STORED) {
+    /* pxor %xmm0, %xmm0 */
+    ctx_push_code(ctx, 0x66, 0x0F, 0xEF, mod_rm(MODE_REG_DIRECT, 0, 0));
+    /* movdqu (%SP_REG + off), %xmm0, the last one overlapping the one before
+     * when the count is not a multiple of 16 */
+    for (int32_t at = 0; at < count; at += 16) {
+      ctx_push_code(ctx, 0xF3, 0x0F, 0x7F);
+      emit_sp_disp(ctx, 0, from + (at + 16 <= count ? at : count - 16));
+    }
+    return COMPILE_OK;
+  }
+  /* push %SP_REG; lea %SP_REG, (%SP_REG + off) */
+  ctx_push_code(ctx, 0x50 + SP_REG);
+  emit_rex_w(ctx);
+  ctx_push_code(ctx, 0x8D);
+  emit_sp_operand(ctx, SP_REG, op.off);
+  /* xor %eax, %eax; mov %ecx, count */
+  ctx_push_code(ctx, 0x31, mod_rm(MODE_REG_DIRECT, REG_EAX, REG_EAX),
+                0xB8 + REG_ECX);
+  vec_push_as_bytes(ctx, &count);
+  /* rep stosb; pop %SP_REG */
+  ctx_push_code(ctx, 0xF3, 0xAA, 0x58 + SP_REG);
+  return COMPILE_OK;
+}
 
-  /* we add 2 to account for encoding short jumps,
-   * or the prefix to a long jump */
-  int32_t offset = -(ctx->length + 2);
+/* cmp (%SP_REG), $0; je (end); add/sub %SP_REG, stride; jmp (cmp), a cell at
+ * a time */
+static compile_result emit_scan_cells(compile_ctx *ctx, ir_op_t op) {
+  compile_ctx move = {.layout = ctx->layout};
+  compile_result err = emit_add_sub(&move, MODE_REG_DIRECT, op);
+  if (err == COMPILE_OK) {
+    size_t cmp = ctx->length;
+    /* cmp (%SP_REG), $0 */
+    uint8_t opcode = emit_cell_size(ctx, 0x80);
+    ctx_push_code(ctx, opcode, mod_rm(MODE_REG_INDIRECT, 0x7, SP_REG), 0x0);
+    /* je (end) */
+    ctx_push_code(ctx, 0x74, (int8_t)(move.length + 2));
+    vec_extend(ctx, &move);
+    /* jmp (cmp) */
+    int8_t offset = cmp - (ctx->length + 2);
+    ctx_push_code(ctx, 0xEB, offset);
+  }
+  vec_deinit(&move);
+  return err;
+}
 
-  /* check if we can do a short jump (accounting for 2 byte jump) */
-  if (offset >= INT8_MIN) {
-    /* jne imm8 (end of loop) */
-    ctx_push_code(ctx, 0x75, (int8_t)(offset));
+/* walks the tape 16 bytes at a time, comparing all the cells in them against
+ * zero and masking out the ones that are not a multiple of the stride away.
+ * the mask has a bit for every byte, the one kept for a cell is its lowest.
+ * the tape sits right between the guards, so the last few cells at either end
+ * go one at a time. */
+static inline compile_result emit_code_scan_sse2(compile_ctx *ctx,
+                                                 ir_op_t op) {
+  static const uint16_t stride_mask[] = {
+      [1] = 0xffff, [2] = 0x5555, [4] = 0x1111, [8] = 0x0101};
+  /* pcmpeqb, pcmpeqw and pcmpeqd */
+  static const uint8_t pcmpeq[] = {[1] = 0x74, [2] = 0x75, [4] = 0x76};
+  uint8_t size = ctx->layout->cell_size;
+  int right = op.arg > 0;
+  int64_t bytes = (right ? op.arg : -op.arg) * size;
+  uint32_t mask = stride_mask[bytes];
+  /* where the current cell starts in the load */
+  int8_t start = right ? 0 : 16 - size;
+  if (!right) {
+    /* line the mask up with the top cell, which is the current one */
+    mask = (mask << (bytes - size)) & 0xffff;
+  }
+
+  compile_ctx found = {.layout = ctx->layout};
+  compile_ctx tail = {.layout = ctx->layout};
+  compile_result err = emit_scan_cells(&tail, op);
+  if (err != COMPILE_OK) {
+    vec_deinit(&tail);
+    return err;
+  }
+  if (right) {
+    /* bsf %eax, %eax */
+    ctx_push_code(&found, 0x0F, 0xBC,
+                  mod_rm(MODE_REG_DIRECT, REG_EAX, REG_EAX));
+    /* add %SP_REG, %eax */
+    emit_rex_w(&found);
+    ctx_push_code(&found, 0x01, mod_rm(MODE_REG_DIRECT, REG_EAX, SP_REG));
   } else {
-    /* jne imm16/imm32 */
-    ctx_push_code(ctx, 0x0F, 0x85); /* 0x0F is a prefix byte */
-    int32_t arg = (int32_t)(offset);
-    /* jumps are relative to end of instruction,
-     * so we must account for the size of the adress itself. */
-    arg -= sizeof(arg);
-    vec_push_as_bytes(ctx, &arg);
+    /* bsr %eax, %eax */
+    ctx_push_code(&found, 0x0F, 0xBD,
+                  mod_rm(MODE_REG_DIRECT, REG_EAX, REG_EAX));
+    /* lea %SP_REG, -start(%SP_REG, %eax) */
+    emit_rex_w(&found);
+    ctx_push_code(&found, 0x8D, mod_rm(MODE_SIB_1, SP_REG, REG_ESP),
+                  sib(0, REG_EAX, SP_REG), (int8_t)-start);
   }
+  /* jmp (end) */
+  ctx_push_code(&found, 0xEB, (int8_t)tail.length);
 
+  /* pxor %xmm1, %xmm1 */
+  ctx_push_code(ctx, 0x66, 0x0F, 0xEF, mod_rm(MODE_REG_DIRECT, 1, 1));
+  size_t loop = ctx->length;
+  /* cmp %SP_REG, guard - 16; ja (tail), or to the left
+   * cmp %SP_REG, tape + start; jb (tail) */
+  uint32_t last = right ? ctx->layout->guard - 16 : ctx->layout->tape + start;
+  emit_rex_w(ctx);
+  ctx_push_code(ctx, 0x81, mod_rm(MODE_REG_DIRECT, 7, SP_REG));
+  vec_push_as_bytes(ctx, &last);
+  ctx_push_code(ctx, right ? 0x77 : 0x72, 0x0);
+  size_t to_tail = ctx->length;
+  /* movdqu %xmm0, (%SP_REG - start) */
+  ctx_push_code(ctx, 0xF3, 0x0F, 0x6F);
+  emit_sp_disp(ctx, 0, -start);
+  /* pcmpeq %xmm0, %xmm1 */
+  ctx_push_code(ctx, 0x66, 0x0F, pcmpeq[size], mod_rm(MODE_REG_DIRECT, 0, 1));
+  /* pmovmskb %eax, %xmm0 */
+  ctx_push_code(ctx, 0x66, 0x0F, 0xD7, mod_rm(MODE_REG_DIRECT, REG_EAX, 0));
+  if (mask != 0xffff) {
+    /* and %eax, imm32 */
+    ctx_push_code(ctx, 0x25);
+    vec_push_as_bytes(ctx, &mask);
+  } else {
+    /* test %eax, %eax */
+    ctx_push_code(ctx, 0x85, mod_rm(MODE_REG_DIRECT, REG_EAX, REG_EAX));
+  }
+  /* jnz (found) */
+  ctx_push_code(ctx, 0x75, ctx->layout->target & TARGET_X86_64 ? 0x06 : 0x05);
+  /* add/sub %SP_REG, 16 */
+  emit_rex_w(ctx);
+  ctx_push_code(ctx, 0x83, mod_rm(MODE_REG_DIRECT, right ? 0 : 5, SP_REG), 16);
+  /* jmp (movdqu) */
+  int8_t offset = loop - (ctx->length + 2);
+  ctx_push_code(ctx, 0xEB, offset);
+
+  ctx->data[to_tail - 1] = (int8_t)(ctx->length + found.length - to_tail);
+  vec_extend(ctx, &found);
+  vec_extend(ctx, &tail);
+  vec_deinit(&found);
+  vec_deinit(&tail);
   return COMPILE_OK;
 }
 
+static inline compile_result emit_code_scan(compile_ctx *ctx, ir_ctx *ctx_ir,
+                                            size_t idx) {
+  ir_op_t op = ir_op_at(ctx_ir, idx);
+  int64_t bytes = (op.arg < 0 ? -op.arg : op.arg) * ctx->layout->cell_size;
+  if (bytes == 1 || bytes == 2 || bytes == 4 || bytes == 8)
+    return emit_code_scan_sse2(ctx, op);
+  return emit_scan_cells(ctx, op);
+}
+
 static const reg_t syscall_arg_reg[] = {REG_EBX, REG_ECX, REG_EDX,
                                         REG_ESI, REG_EDI, REG_EBP};
 
@@ -220,62 +732,239 @@ static const reg_t syscall_arg_reg[] = {REG_EBX, REG_ECX, REG_EDX,
 #define syscall_reg_arg(ctx, n, reg)                                           \
   ctx_push_code(ctx, 0x89, mod_rm(MODE_REG_DIRECT, reg, syscall_arg_reg[n]))
 
-/* yeah this is kinda broken. it need to mov from one reg to another */
+/* the x86-64 numbers of the i386 syscalls */
+static const uint32_t syscall_x86_64[] = {
+    [SYS_EXIT] = 60,     [SYS_READ] = 0,          [SYS_WRITE] = 1,
+    [SYS_MPROTECT] = 10, [SYS_RT_SIGACTION] = 13,
+};
+
+/* makes the syscall with its arguments in %ebx, %ecx and %edx, returning in
+ * %eax. x86-64 wants them in %rdi and %rsi, so %SP_REG and %OUT_REG are kept
+ * in %r8 and %r9 over the syscall, and the %ecx it clobbers is put back. */
+static void emit_syscall(compile_ctx *ctx, syscall_t nr) {
+  if (!(ctx->layout->target & TARGET_X86_64)) {
+    /* mov $nr, %eax; int $0x80 */
+    ctx_push_code(ctx, 0xb8 + REG_EAX, nr, 0x0, 0x0, 0x0);
+    ctx_push_code(ctx, 0xcd, 0x80);
+    return;
+  }
+
+  /* mov %rdi, %r8; mov %rsi, %r9; mov %ebx, %edi; mov %ecx, %esi */
+  emit_mov_reg64(ctx, REG_R8, REG_EDI);
+  emit_mov_reg64(ctx, REG_R9, REG_ESI);
+  ctx_push_code(ctx, 0x89, mod_rm(MODE_REG_DIRECT, REG_EBX, REG_EDI));
+  ctx_push_code(ctx, 0x89, mod_rm(MODE_REG_DIRECT, REG_ECX, REG_ESI));
+  /* mov $nr, %eax; syscall */
+  ctx_push_code(ctx, 0xb8 + REG_EAX);
+  vec_push_as_bytes(ctx, &syscall_x86_64[nr]);
+  ctx_push_code(ctx, 0x0F, 0x05);
+  /* mov %esi, %ecx; mov %r9, %rsi; mov %r8, %rdi */
+  ctx_push_code(ctx, 0x89, mod_rm(MODE_REG_DIRECT, REG_ESI, REG_ECX));
+  emit_mov_reg64(ctx, REG_ESI, REG_R9);
+  emit_mov_reg64(ctx, REG_EDI, REG_R8);
+}
+
+/* flushing clobbers %eax, %ebx, %ecx and %edx */
+static inline void emit_call_flush(compile_ctx *ctx) {
+  /* mov $flush, %eax */
+  ctx_push_code(ctx, 0xb8 + REG_EAX);
+  vec_push_as_bytes(ctx, &ctx->layout->flush);
+  /* call *%eax */
+  ctx_push_code(ctx, 0xFF, mod_rm(MODE_REG_DIRECT, 2, REG_EAX));
+}
+
+/* writes out the output buffer, then empties it. */
+static void emit_flush(compile_ctx *ctx) {
+  uint32_t out_buf = ctx->layout->out_buf;
+  int32_t fd = STDOUT_FILENO;
+
+  compile_ctx write = {.layout = ctx->layout};
+  syscall_const_arg(&write, 0, &fd);
+  emit_syscall(&write, SYS_WRITE);
+
+  /* mov $out_buf, %ecx */
+  ctx_push_code(ctx, 0xb8 + REG_ECX);
+  vec_push_as_bytes(ctx, &out_buf);
+  size_t again = ctx->length;
+  /* mov %OUT_REG, %edx; sub %ecx, %edx */
+  ctx_push_code(ctx, 0x89, mod_rm(MODE_REG_DIRECT, OUT_REG, REG_EDX));
+  ctx_push_code(ctx, 0x29, mod_rm(MODE_REG_DIRECT, REG_ECX, REG_EDX));
+  /* jbe done */
+  ctx_push_code(ctx, 0x76, (int8_t)(write.length + 8));
+  /* write(STDOUT_FILENO, %ecx, %edx) */
+  vec_extend(ctx, &write);
+  vec_deinit(&write);
+  /* give up on errors, otherwise carry on after what got written */
+  /* test %eax, %eax; jle done */
+  ctx_push_code(ctx, 0x85, mod_rm(MODE_REG_DIRECT, REG_EAX, REG_EAX));
+  ctx_push_code(ctx, 0x7E, 4);
+  /* add %eax, %ecx; jmp again */
+  ctx_push_code(ctx, 0x01, mod_rm(MODE_REG_DIRECT, REG_EAX, REG_ECX));
+  int8_t offset = again - (ctx->length + 2);
+  ctx_push_code(ctx, 0xEB, offset);
+  /* done: mov $out_buf, %OUT_REG; ret */
+  ctx_push_code(ctx, 0xb8 + OUT_REG);
+  vec_push_as_bytes(ctx, &out_buf);
+  ctx_push_code(ctx, 0xC3);
+}
+
+/* appends the cell to the output buffer count times, flushing it first if
+ * there is no room */
 static inline compile_result emit_code_write(compile_ctx *ctx, ir_ctx *ctx_ir,
                                              size_t idx) {
-  ir_op_t op = ctx_ir->data[idx];
+  ir_op_t op = ir_op_at(ctx_ir, idx);
   if (op.arg > INT32_MAX || op.arg < INT32_MIN) {
     return COMPILE_OPERAND_SIZE;
   }
 
-  /* the loop is here because the syscall clobbers the registers
-   * it uses for its arguments with its return value */
-  for (int64_t i = 0; i < op.arg; i++) {
-    int32_t fd = STDOUT_FILENO;
-    uint8_t argc = 0;
-
-    /* mov SYS_WRITE, %eax */
-    ctx_push_code(ctx, 0xb8 + REG_EAX, SYS_WRITE, 0x0, 0x0, 0x0);
-    syscall_const_arg(ctx, argc++, &fd);
-    /* mov %edi, %ecx */
-    syscall_reg_arg(ctx, argc, SP_REG);
-    /* we have to do this outside since the macro expansion is not hygenic :(
-     */
-    argc += 1;
-    fd = 1;
-    /* mov $1, %esi */
-    syscall_const_arg(ctx, argc++, &fd);
-
-    /* create a loop. i am feeling kinda of lazy so we just emit a bunch of
-     * interrupts. */
-    /* int $0x80 */
-    ctx_push_code(ctx, 0xcd, 0x80);
+  for (uint32_t left = op.arg; left > 0;) {
+    uint32_t count = left;
+    if (count > ctx->layout->out_len)
+      count = ctx->layout->out_len;
+    left -= count;
+
+    /* cmp $(end - count), %OUT_REG; jbe fits */
+    uint32_t last = ctx->layout->out_buf + ctx->layout->out_len - count;
+    emit_rex_w(ctx);
+    ctx_push_code(ctx, 0x81, mod_rm(MODE_REG_DIRECT, 7, OUT_REG));
+    vec_push_as_bytes(ctx, &last);
+    ctx_push_code(ctx, 0x76, 7);
+    emit_call_flush(ctx);
+
+    /* mov (%SP_REG + off), %al */
+    ctx_push_code(ctx, 0x8A);
+    emit_sp_operand(ctx, REG_EAX, op.off);
+    if (count < 8) {
+      for (uint32_t i = 0; i < count; i++) {
+        /* mov %al, (%OUT_REG + i) */
+        if (i == 0)
+          ctx_push_code(ctx, 0x88, mod_rm(MODE_REG_INDIRECT, REG_EAX, OUT_REG));
+        else
+          ctx_push_code(ctx, 0x88, mod_rm(MODE_SIB_1, REG_EAX, OUT_REG), i);
+      }
+      /* add $count, %OUT_REG */
+      emit_rex_w(ctx);
+      ctx_push_code(ctx, 0x83, mod_rm(MODE_REG_DIRECT, 0, OUT_REG), count);
+    } else {
+      /* stos only stores through %edi, so swap it with the output pointer */
+      /* mov $count, %ecx; xchg %OUT_REG, %edi; rep stosb; xchg back */
+      ctx_push_code(ctx, 0xb8 + REG_ECX);
+      vec_push_as_bytes(ctx, &count);
+      emit_rex_w(ctx);
+      ctx_push_code(ctx, 0x87, mod_rm(MODE_REG_DIRECT, OUT_REG, REG_EDI));
+      ctx_push_code(ctx, 0xF3, 0xAA);
+      emit_rex_w(ctx);
+      ctx_push_code(ctx, 0x87, mod_rm(MODE_REG_DIRECT, OUT_REG, REG_EDI));
+    }
   }
 
   return COMPILE_OK;
 }
 
+/* emits the mod r/m and sib bytes addressing the absolute address addr */
+static inline void emit_abs_operand(compile_ctx *ctx, uint8_t reg,
+                                    uint32_t addr) {
+  ctx_push_code(ctx, mod_rm(MODE_REG_INDIRECT, reg, REG_ESP),
+                sib(0, REG_ESP, REG_EBP));
+  vec_push_as_bytes(ctx, &addr);
+}
+
+/* refills the input buffer, returning its first byte in %ecx, or the eof value
+ * (-1 if the cell is to be left alone) when there is no more input */
+static void emit_getc(compile_ctx *ctx) {
+  compile_layout_t *layout = ctx->layout;
+  int32_t fd = STDIN_FILENO;
+  int32_t eof = layout->eof == EOF_UNCHANGED ? -1 : layout->eof;
+
+  /* anything written so far has to be out before we wait for input */
+  emit_call_flush(ctx);
+  /* read(STDIN_FILENO, in_buf, in_len) */
+  syscall_const_arg(ctx, 0, &fd);
+  syscall_const_arg(ctx, 1, &layout->in_buf);
+  syscall_const_arg(ctx, 2, &layout->in_len);
+  emit_syscall(ctx, SYS_READ);
+  /* test %eax, %eax; jle eof */
+  ctx_push_code(ctx, 0x85, mod_rm(MODE_REG_DIRECT, REG_EAX, REG_EAX));
+  ctx_push_code(ctx, 0x7E, 23);
+  /* add %ecx, %eax; mov %eax, (in_end) */
+  ctx_push_code(ctx, 0x01, mod_rm(MODE_REG_DIRECT, REG_ECX, REG_EAX));
+  ctx_push_code(ctx, 0x89);
+  emit_abs_operand(ctx, REG_EAX, layout->in_ptr + 4);
+  /* lea 1(%ecx), %eax; mov %eax, (in_ptr) */
+  ctx_push_code(ctx, 0x8D, mod_rm(MODE_SIB_1, REG_EAX, REG_ECX), 1);
+  ctx_push_code(ctx, 0x89);
+  emit_abs_operand(ctx, REG_EAX, layout->in_ptr);
+  /* movzx (%ecx), %ecx; ret */
+  ctx_push_code(ctx, 0x0F, 0xB6, mod_rm(MODE_REG_INDIRECT, REG_ECX, REG_ECX));
+  ctx_push_code(ctx, 0xC3);
+  /* eof: mov $eof, %ecx; ret */
+  ctx_push_code(ctx, 0xb8 + REG_ECX);
+  vec_push_as_bytes(ctx, &eof);
+  ctx_push_code(ctx, 0xC3);
+}
+
+/* takes the next byte out of the input buffer, only calling out to getc when
+ * it has run dry */
+static void emit_read_byte(compile_ctx *ctx, int32_t off) {
+  compile_layout_t *layout = ctx->layout;
+
+  /* mov (in_ptr), %eax; cmp (in_end), %eax; jae slow */
+  ctx_push_code(ctx, 0x8B);
+  emit_abs_operand(ctx, REG_EAX, layout->in_ptr);
+  ctx_push_code(ctx, 0x3B);
+  emit_abs_operand(ctx, REG_EAX, layout->in_ptr + 4);
+  ctx_push_code(ctx, 0x73, 14);
+  /* movzx (%eax), %ecx; inc %eax; mov %eax, (in_ptr); jmp store */
+  ctx_push_code(ctx, 0x0F, 0xB6, mod_rm(MODE_REG_INDIRECT, REG_ECX, REG_EAX));
+  ctx_push_code(ctx, 0xFF, mod_rm(MODE_REG_DIRECT, 0, REG_EAX));
+  ctx_push_code(ctx, 0x89);
+  emit_abs_operand(ctx, REG_EAX, layout->in_ptr);
+  ctx_push_code(ctx, 0xEB, 7);
+  /* slow: mov $getc, %eax; call *%eax */
+  ctx_push_code(ctx, 0xb8 + REG_EAX);
+  vec_push_as_bytes(ctx, &layout->getc);
+  ctx_push_code(ctx, 0xFF, mod_rm(MODE_REG_DIRECT, 2, REG_EAX));
+
+  /* store: mov %cl/%cx/%ecx, (%SP_REG + off) */
+  compile_ctx store = {.layout = layout};
+  uint8_t opcode = emit_cell_size(&store, 0x88);
+  ctx_push_code(&store, opcode);
+  emit_sp_operand(&store, REG_ECX, off);
+  if (layout->eof == EOF_UNCHANGED) {
+    /* test %ecx, %ecx; js over the store */
+    ctx_push_code(ctx, 0x85, mod_rm(MODE_REG_DIRECT, REG_ECX, REG_ECX));
+    ctx_push_code(ctx, 0x78, (int8_t)store.length);
+  }
+  vec_extend(ctx, &store);
+  vec_deinit(&store);
+}
+
+/* every read takes a byte, so runs loop with their count on the stack */
 static inline compile_result emit_code_read(compile_ctx *ctx, ir_ctx *ctx_ir,
                                             size_t idx) {
-  ir_op_t op = ctx_ir->data[idx];
+  ir_op_t op = ir_op_at(ctx_ir, idx);
   if (op.arg > INT32_MAX || op.arg < INT32_MIN) {
     return COMPILE_OPERAND_SIZE;
   }
-  int32_t fd = STDIN_FILENO;
-  uint8_t argc = 0;
-
-  /* mov SYS_READ, %eax */
-  ctx_push_code(ctx, 0xb8 + REG_EAX, SYS_READ, 0x0, 0x0, 0x0);
-  syscall_const_arg(ctx, argc++, &fd);
-  /* mov %edi, %ecx */
-  syscall_reg_arg(ctx, argc, SP_REG);
-  /* we have to do this outside since the macro expansion is not hygenic :( */
-  argc += 1;
-  fd = 1;
-  /* mov $1, %esi */
-  syscall_const_arg(ctx, argc++, &fd);
-  /* int $0x80 */
-  ctx_push_code(ctx, 0xcd, 0x80);
+  if (op.arg == 1) {
+    emit_read_byte(ctx, op.off);
+    return COMPILE_OK;
+  }
+
+  int32_t count = op.arg;
+  compile_ctx body = {.layout = ctx->layout};
+  emit_read_byte(&body, op.off);
+  /* decl (%esp) */
+  ctx_push_code(&body, 0xFF, mod_rm(MODE_REG_INDIRECT, 1, REG_ESP),
+                sib(0, REG_ESP, REG_ESP));
+
+  /* push $count; again: ...; jnz again; pop %ecx */
+  ctx_push_code(ctx, 0x68);
+  vec_push_as_bytes(ctx, &count);
+  vec_extend(ctx, &body);
+  ctx_push_code(ctx, 0x75, (int8_t)-(body.length + 2));
+  ctx_push_code(ctx, 0x58 + REG_ECX);
+  vec_deinit(&body);
   return COMPILE_OK;
 }
 
@@ -289,7 +978,7 @@ static inline compile_result emit_code_trap(compile_ctx *ctx, ir_ctx *ctx_ir,
 
 static inline compile_result emit_code_exit(compile_ctx *ctx, ir_ctx *ctx_ir,
                                             size_t idx) {
-  ir_op_t op = ctx_ir->data[idx];
+  ir_op_t op = ir_op_at(ctx_ir, idx);
   if (op.arg > INT32_MAX || op.arg < INT32_MIN) {
     return COMPILE_OPERAND_SIZE;
   }
@@ -300,64 +989,624 @@ static inline compile_result emit_code_exit(compile_ctx *ctx, ir_ctx *ctx_ir,
   ctx_push_code(ctx, 0x8F, mod_rm(MODE_REG_DIRECT, 0, REG_EAX));
 #endif
 
-  /* mov SYS_EXIT, %eax */
-  ctx_push_code(ctx, 0xb8 + REG_EAX, SYS_EXIT, 0x0, 0x0, 0x0);
+  emit_call_flush(ctx);
+  if (ctx->layout->target & TARGET_JIT) {
+    /* return to whoever called the code, see ir_ctx_compile */
+    /* pop %rax; pop %rbx; ret */
+    ctx_push_code(ctx, 0x58 + REG_EAX, 0x58 + REG_EBX, 0xC3);
+    return COMPILE_OK;
+  }
   int32_t arg = op.arg;
   syscall_const_arg(ctx, 0, &arg);
-  /* int $0x80 */
-  ctx_push_code(ctx, 0xcd, 0x80);
+  emit_syscall(ctx, SYS_EXIT);
+  return COMPILE_OK;
+}
+
+/* writes out length bytes from addr in one go, for output that was already
+ * worked out at compile time */
+compile_result ir_compile_write_data(compile_ctx *ctx, uint32_t addr,
+                                     uint32_t length) {
+  int32_t fd = STDOUT_FILENO;
+
+  syscall_const_arg(ctx, 0, &fd);
+  syscall_const_arg(ctx, 1, &addr);
+  syscall_const_arg(ctx, 2, &length);
+  emit_syscall(ctx, SYS_WRITE);
   return COMPILE_OK;
 }
 
-/* lifted outside the function to avoid stack overflow */
-char err_buf[500];
+
+#define SIGSEGV_NR 11
+/* the kernel's sigaction flags. x86-64 will not deliver a signal without a
+ * restorer, which the handler never returns to anyway */
+#define KERNEL_SA_SIGINFO 0x4
+#define KERNEL_SA_RESTORER 0x04000000
+/* what a program that ran off the tape exits with */
+#define EXIT_OFF_TAPE 1
+
+static const char off_tape_message[] = "out of bounds tape access at cell ";
+
+/* the handler for tape accesses that ran into the guard, placed at addr. it
+ * gets the faulting address out of the siginfo and the output pointer out of
+ * the ucontext, writes out what the program printed so far, reports the cell
+ * relative to the start of the tape and exits. the message and the kernel's
+ * struct sigaction come first, returns where that struct is. */
+static uint32_t emit_segv_handler(compile_ctx *ctx, uint32_t addr) {
+  int x86_64 = ctx->layout->target & TARGET_X86_64;
+  uint32_t message_len = sizeof(off_tape_message) - 1;
+  vec_pusharr(ctx, off_tape_message, message_len);
+
+  /* handler, flags, restorer and mask, each a word wide */
+  uint32_t act = addr + ctx->length;
+  uint32_t word = x86_64 ? 8 : 4;
+  uint32_t handler = act + 3 * word + 8;
+  uint64_t fields[] = {handler, KERNEL_SA_SIGINFO | KERNEL_SA_RESTORER,
+                       handler};
+  for (size_t i = 0; i < 3; i++)
+    vec_pusharr(ctx, (uint8_t *)&fields[i], word);
+  uint64_t mask = 0;
+  vec_push_as_bytes(ctx, &mask);
+
+  if (x86_64) {
+    /* mov %rsi, %rbx */
+    emit_mov_reg64(ctx, REG_EBX, REG_ESI);
+  } else {
+    /* mov 8(%esp), %ebx; mov 12(%esp), %edx */
+    ctx_push_code(ctx, 0x8B, mod_rm(MODE_SIB_1, REG_EBX, REG_ESP),
+                  sib(0, REG_ESP, REG_ESP), 8);
+    ctx_push_code(ctx, 0x8B, mod_rm(MODE_SIB_1, REG_EDX, REG_ESP),
+                  sib(0, REG_ESP, REG_ESP), 12);
+  }
+  /* mov si_addr(%ebx), %eax; mov esi_reg(%edx), %OUT_REG */
+  ctx_push_code(ctx, 0x8B, mod_rm(MODE_SIB_1, REG_EAX, REG_EBX),
+                x86_64 ? 16 : 12);
+  ctx_push_code(ctx, 0x8B, mod_rm(MODE_SIB_1, OUT_REG, REG_EDX),
+                x86_64 ? 112 : 40);
+  /* push %eax; (flush); pop %eax */
+  ctx_push_code(ctx, 0x50 + REG_EAX);
+  emit_call_flush(ctx);
+  ctx_push_code(ctx, 0x58 + REG_EAX);
+  /* sub $tape, %eax; sar $log2(cell_size), %eax; mov %eax, %ebp */
+  ctx_push_code(ctx, 0x2D);
+  vec_push_as_bytes(ctx, &ctx->layout->tape);
+  if (ctx->layout->cell_size > 1)
+    ctx_push_code(ctx, 0xC1, mod_rm(MODE_REG_DIRECT, 7, REG_EAX),
+                  __builtin_ctz(ctx->layout->cell_size));
+  ctx_push_code(ctx, 0x89, mod_rm(MODE_REG_DIRECT, REG_EAX, REG_EBP));
+
+  int32_t fd = STDERR_FILENO;
+  syscall_const_arg(ctx, 0, &fd);
+  syscall_const_arg(ctx, 1, &addr);
+  syscall_const_arg(ctx, 2, &message_len);
+  emit_syscall(ctx, SYS_WRITE);
+
+  /* the cell in decimal, written backwards from 16(%OUT_REG) */
+  /* mov %ebp, %eax; test %eax, %eax; jns 2; neg %eax */
+  ctx_push_code(ctx, 0x89, mod_rm(MODE_REG_DIRECT, REG_EBP, REG_EAX));
+  ctx_push_code(ctx, 0x85, mod_rm(MODE_REG_DIRECT, REG_EAX, REG_EAX));
+  ctx_push_code(ctx, 0x79, 2, 0xF7, mod_rm(MODE_REG_DIRECT, 3, REG_EAX));
+  /* lea 15(%OUT_REG), %ecx; movb $'\n', (%ecx); mov $10, %ebx */
+  ctx_push_code(ctx, 0x8D, mod_rm(MODE_SIB_1, REG_ECX, OUT_REG), 15);
+  ctx_push_code(ctx, 0xC6, mod_rm(MODE_REG_INDIRECT, 0, REG_ECX), '\n');
+  ctx_push_code(ctx, 0xb8 + REG_EBX, 10, 0, 0, 0);
+  /* digit: xor %edx, %edx; div %ebx; add $'0', %dl; dec %ecx;
+   * mov %dl, (%ecx); test %eax, %eax; jnz digit */
+  ctx_push_code(ctx, 0x31, mod_rm(MODE_REG_DIRECT, REG_EDX, REG_EDX));
+  ctx_push_code(ctx, 0xF7, mod_rm(MODE_REG_DIRECT, 6, REG_EBX));
+  ctx_push_code(ctx, 0x80, mod_rm(MODE_REG_DIRECT, 0, REG_EDX), '0');
+  ctx_push_code(ctx, 0xFF, mod_rm(MODE_REG_DIRECT, 1, REG_ECX));
+  ctx_push_code(ctx, 0x88, mod_rm(MODE_REG_INDIRECT, REG_EDX, REG_ECX));
+  ctx_push_code(ctx, 0x85, mod_rm(MODE_REG_DIRECT, REG_EAX, REG_EAX));
+  ctx_push_code(ctx, 0x75, (int8_t)-15);
+  /* test %ebp, %ebp; jns 5; dec %ecx; movb $'-', (%ecx) */
+  ctx_push_code(ctx, 0x85, mod_rm(MODE_REG_DIRECT, REG_EBP, REG_EBP));
+  ctx_push_code(ctx, 0x79, 5, 0xFF, mod_rm(MODE_REG_DIRECT, 1, REG_ECX));
+  ctx_push_code(ctx, 0xC6, mod_rm(MODE_REG_INDIRECT, 0, REG_ECX), '-');
+  /* lea 16(%OUT_REG), %edx; sub %ecx, %edx */
+  ctx_push_code(ctx, 0x8D, mod_rm(MODE_SIB_1, REG_EDX, OUT_REG), 16);
+  ctx_push_code(ctx, 0x29, mod_rm(MODE_REG_DIRECT, REG_ECX, REG_EDX));
+  syscall_const_arg(ctx, 0, &fd);
+  emit_syscall(ctx, SYS_WRITE);
+
+  int32_t status = EXIT_OFF_TAPE;
+  syscall_const_arg(ctx, 0, &status);
+  emit_syscall(ctx, SYS_EXIT);
+  return act;
+}
+
+/* takes away access to the guards on either side of the tape, in case the
+ * loader mapped them after all, and has accesses that land in them reported.
+ * clobbers %OUT_REG. */
+static void emit_install_guard(compile_ctx *ctx, uint32_t act) {
+  uint32_t prot_none = 0, signal = SIGSEGV_NR, null = 0, mask_len = 8;
+  uint32_t guards[] = {ctx->layout->front_guard, ctx->layout->guard};
+  for (size_t i = 0; i < 2; i++) {
+    /* mprotect(guard, guard_len, PROT_NONE) */
+    syscall_const_arg(ctx, 0, &guards[i]);
+    syscall_const_arg(ctx, 1, &ctx->layout->guard_len);
+    syscall_const_arg(ctx, 2, &prot_none);
+    emit_syscall(ctx, SYS_MPROTECT);
+  }
+
+  /* rt_sigaction(SIGSEGV, act, NULL, sizeof(mask)), the last argument goes
+   * in %esi or %r10 */
+  syscall_const_arg(ctx, 0, &signal);
+  syscall_const_arg(ctx, 1, &act);
+  syscall_const_arg(ctx, 2, &null);
+  if (ctx->layout->target & TARGET_X86_64)
+    ctx_push_code(ctx, rex(0, 0, 0, 1), 0xb8 + (REG_R10 & 7));
+  else
+    ctx_push_code(ctx, 0xb8 + REG_ESI);
+  vec_push_as_bytes(ctx, &mask_len);
+  emit_syscall(ctx, SYS_RT_SIGACTION);
+}
 
 /* lifter outside since there is no reason to have this
  * inside the function body */
 static compile_result (*code_fn[])(compile_ctx *, ir_ctx *, size_t) = {
     [IR_OP_TAPE] = emit_code_tape,
     [IR_OP_CELL] = emit_code_cell,
-    [IR_OP_LOOP_START] = emit_code_loop_start,
-    [IR_OP_LOOP_END] = emit_code_loop_end,
     [IR_OP_WRITE] = emit_code_write,
     [IR_OP_READ] = emit_code_read,
-    [IR_OP_SET] = emit_code_trap,
+    [IR_OP_SET] = emit_code_set,
+    [IR_OP_MUL] = emit_code_mul,
+    [IR_OP_SCAN] = emit_code_scan,
+    [IR_OP_VADD] = emit_code_vadd,
+    [IR_OP_VSET] = emit_code_vset,
+    [IR_OP_CLEAR] = emit_code_clear,
     [IR_OP_MAX] = emit_code_exit,
 };
 
-size_t ir_ctx_compile__(compile_ctx *ctx, ir_ctx *ctx_ir, size_t idx) {
+static int compare_off(const void *a, const void *b) {
+  int32_t x = *(const int32_t *)a, y = *(const int32_t *)b;
+  return (x > y) - (x < y);
+}
+
+/* picks the cells to keep in registers over the loop starting at idx: its own
+ * cell, then the ones used the most. only innermost loops that never move get
+ * any, their cells stay put for the whole body. */
+static cell_regs_t alloc_cell_regs(compile_ctx *ctx, ir_ctx *ctx_ir,
+                                   size_t idx) {
+  uint8_t max = cell_reg_count(ctx);
+  cell_regs_t regs = {0};
+  vec_t(int32_t) offs = {0};
+  for (size_t i = idx + 1; ir_kind_at(ctx_ir, i) != IR_OP_LOOP_END; i++) {
+    ir_op_t op = ir_op_at(ctx_ir, i);
+    if (op.kind == IR_OP_CELL || op.kind == IR_OP_SET || op.kind == IR_OP_MUL) {
+      if (op.off != 0)
+        vec_push(&offs, op.off);
+    } else if (op.kind != IR_OP_WRITE && op.kind != IR_OP_READ) {
+      vec_deinit(&offs);
+      return regs;
+    }
+  }
+
+  regs.off[regs.count++] = 0;
+  size_t uses[CELL_REGS] = {0};
+  qsort(offs.data, offs.length, sizeof(*offs.data), compare_off);
+  for (size_t run = 0, end = 0; run < offs.length; run = end) {
+    while (end < offs.length && offs.data[end] == offs.data[run])
+      end++;
+    size_t n = end - run;
+    if (regs.count < max)
+      regs.count++;
+    else if (n <= uses[max - 1])
+      continue;
+    /* insert it, keeping them sorted by use */
+    uint8_t k = regs.count - 1;
+    for (; k > 1 && uses[k - 1] < n; k--) {
+      regs.off[k] = regs.off[k - 1];
+      uses[k] = uses[k - 1];
+    }
+    regs.off[k] = offs.data[run];
+    uses[k] = n;
+  }
+  vec_deinit(&offs);
+  return regs;
+}
+
+/* moves cells between the tape and their registers, 0x8A loads and 0x88
+ * stores */
+static void emit_cell_regs(compile_ctx *ctx, cell_regs_t *regs,
+                           uint8_t opcode) {
+  for (uint8_t i = 0; i < regs->count; i++) {
+    uint8_t sized = emit_cell_size(ctx, opcode);
+    if (cell_reg[i] > 7)
+      ctx_push_code(ctx, rex(0, 1, 0, 0));
+    ctx_push_code(ctx, sized);
+    emit_sp_operand(ctx, cell_reg[i] & 7, regs->off[i]);
+  }
+}
+
+/* loops shorter than this are cheaper to repeat than to call */
+#define OUTLINE_MIN_OPS 8
+#define OUTLINE_MIN_COUNT 3
+
+/* a loop compiled once, which every copy of it calls */
+typedef struct {
+  size_t idx; /* where it first shows up in the ir */
+  int64_t at; /* where its code starts, -1 until it is first called */
+} routine_t;
+
+typedef vec_t(routine_t) routine_vec_t;
+
+typedef struct {
+  uint64_t hash;
+  size_t idx;
+} loop_key_t;
+
+static uint64_t hash_loop(ir_ctx *ctx_ir, size_t idx) {
+  uint64_t hash = 0xcbf29ce484222325ull;
+  size_t end = idx + ir_op_at(ctx_ir, idx).arg;
+  for (size_t i = idx; i <= end; i++) {
+    ir_op_t op = ir_op_at(ctx_ir, i);
+    uint64_t fields[] = {op.kind, (uint32_t)op.off, op.arg};
+    for (size_t j = 0; j < sizeof(fields) / sizeof(*fields); j++)
+      hash = (hash ^ fields[j]) * 0x100000001b3ull;
+  }
+  return hash;
+}
+
+static int same_loop(ir_ctx *ctx_ir, size_t a, size_t b) {
+  size_t length = ir_op_at(ctx_ir, a).arg;
+  for (size_t i = 0; i <= length; i++) {
+    ir_op_t x = ir_op_at(ctx_ir, a + i), y = ir_op_at(ctx_ir, b + i);
+    if (x.kind != y.kind || x.off != y.off || x.arg != y.arg)
+      return 0;
+  }
+  return 1;
+}
+
+static int compare_loop_key(const void *a, const void *b) {
+  const loop_key_t *x = a, *y = b;
+  if (x->hash != y->hash)
+    return (x->hash > y->hash) - (x->hash < y->hash);
+  return (x->idx > y->idx) - (x->idx < y->idx);
+}
+
+/* finds the loops that show up often enough to be worth outlining. returns,
+ * for every op, the routine its loop gets compiled into plus one, or 0. */
+static size_t *find_routines(ir_ctx *ctx_ir, routine_vec_t *routines) {
+  size_t *outline = calloc(ctx_ir->length, sizeof(*outline));
+  vec_t(loop_key_t) keys = {0};
+  for (size_t i = 0; i < ctx_ir->length; i++) {
+    ir_op_t op = ir_op_at(ctx_ir, i);
+    if ((op.kind == IR_OP_LOOP_START || op.kind == IR_OP_LOOP_ENTER) &&
+        op.arg + 1 >= OUTLINE_MIN_OPS)
+      vec_push(&keys, ((loop_key_t){hash_loop(ctx_ir, i), i}));
+  }
+  qsort(keys.data, keys.length, sizeof(*keys.data), compare_loop_key);
+
+  /* the keys are sorted by hash, so copies sit next to each other */
+  for (size_t run = 0, end = 0; run < keys.length; run = end) {
+    while (end < keys.length && keys.data[end].hash == keys.data[run].hash)
+      end++;
+    for (size_t i = run; i < end; i++) {
+      size_t first = keys.data[i].idx, count = 0;
+      if (outline[first])
+        continue;
+      for (size_t j = i; j < end; j++)
+        count += same_loop(ctx_ir, first, keys.data[j].idx);
+      if (count < OUTLINE_MIN_COUNT)
+        continue;
+      vec_push(routines, ((routine_t){first, -1}));
+      for (size_t j = i; j < end; j++) {
+        if (same_loop(ctx_ir, first, keys.data[j].idx))
+          outline[keys.data[j].idx] = routines->length;
+      }
+    }
+  }
+  vec_deinit(&keys);
+  return outline;
+}
+
+typedef struct {
+  jump_vec_t jumps;
+  /* the test of each open loop (-1 when it has none) and its body's offset */
+  vec_t(int64_t) loops;
+  /* the jump back and the end of each loop closed here but opened in an
+   * earlier chunk, which compile_program ties up */
+  vec_t(size_t) ends;
+  routine_vec_t routines;
+  vec_t(size_t) called; /* routines called, in order and with repeats */
+  size_t *outline;
+} compile_state_t;
+
+/* compiles the ops in [from, to). a loop that got outlined is called instead,
+ * unless it is the routine being compiled, which starts at self. */
+static compile_result compile_range(compile_ctx *ctx, ir_ctx *ctx_ir,
+                                    compile_state_t *state, size_t from,
+                                    size_t to, size_t self) {
   compile_result err = COMPILE_OK;
+  jump_vec_t *jumps = &state->jumps;
+  /* the cell registers, while they are written back for io */
+  cell_regs_t spilled = {0};
 
-  for (size_t i = idx; i < ctx_ir->length; i++) {
-    ir_op_t opcode = ctx_ir->data[i];
-    if (opcode.kind == IR_OP_LOOP_START) {
-      compile_ctx loop_code = {0};
-      /* an OK approximation maybe? */
-      vec_reserve(&loop_code, ctx_ir->data[i].arg * 2);
-      err = ir_ctx_compile__(&loop_code, ctx_ir, i + 1);
-      if (err == COMPILE_OK) {
-        err = emit_code_loop_start(ctx, ctx_ir, loop_code.length);
-        vec_extend(ctx, &loop_code);
-        /* skip to end of loop body */
-        i += opcode.arg;
+  for (size_t i = from; i < to && err == COMPILE_OK; i++) {
+    ir_op_t opcode = ir_op_at(ctx_ir, i);
+    /* io works on the tape and calls out to routines clobbering registers */
+    int io = opcode.kind == IR_OP_WRITE || opcode.kind == IR_OP_READ;
+    if (io && ctx->regs.count) {
+      emit_cell_regs(ctx, &ctx->regs, 0x88);
+      spilled = ctx->regs;
+      ctx->regs.count = 0;
+    } else if (!io && spilled.count) {
+      emit_cell_regs(ctx, &spilled, 0x8A);
+      ctx->regs = spilled;
+      spilled.count = 0;
+    }
+
+    size_t routine = state->outline[i];
+    if (routine-- && i != self) {
+      vec_push(&state->called, routine);
+      /* call placeholder */
+      vec_push(jumps, ((jump_t){.at = ctx->length,
+                                .target = routine,
+                                .cc = JUMP_CALL,
+                                .is_long = 1}));
+      ctx_push_code(ctx, 0xE8, 0x0, 0x0, 0x0, 0x0);
+      ctx->peephole = (peephole_t){0};
+      i += opcode.arg;
+      continue;
+    }
+
+    switch (opcode.kind) {
+    case IR_OP_LOOP_START:
+    case IR_OP_LOOP_ENTER:
+      /* loops entered with a nonzero cell can skip straight to the body */
+      if (opcode.kind == IR_OP_LOOP_START)
+        vec_push(&state->loops, emit_loop_jump(ctx, jumps, 0x4, 0));
+      else
+        vec_push(&state->loops, -1);
+      ctx->regs = alloc_cell_regs(ctx, ctx_ir, i);
+      emit_cell_regs(ctx, &ctx->regs, 0x8A);
+      vec_push(&state->loops, ctx->length);
+      /* the body gets jumped to, nothing carries over into its start */
+      ctx->peephole = (peephole_t){0};
+      break;
+    case IR_OP_LOOP_END: {
+      if (state->loops.length < 2) {
+        vec_push(&state->ends, emit_loop_jump(ctx, jumps, 0x5, 0));
+        emit_cell_regs(ctx, &ctx->regs, 0x88);
+        ctx->regs.count = 0;
+        vec_push(&state->ends, ctx->length);
+        break;
       }
-      vec_deinit(&loop_code);
-    } else {
+      size_t body = vec_pop(&state->loops);
+      int64_t test = vec_pop(&state->loops);
+      emit_loop_jump(ctx, jumps, 0x5, body);
+      emit_cell_regs(ctx, &ctx->regs, 0x88);
+      ctx->regs.count = 0;
+      if (test >= 0)
+        jumps->data[test].target = ctx->length;
+      break;
+    }
+    default:
       err = code_fn[opcode.kind](ctx, ctx_ir, i);
     }
 
     if (err != COMPILE_OK) {
-      ir_fmt_op(opcode, err_buf);
-      fprintf(stderr, "compiler error: [%s] %s\n", err_buf,
+      char buf[500];
+      ir_fmt_op(opcode, buf);
+      fprintf(stderr, "compiler error: [%s] %s\n", buf,
               compile_result_str[err]);
-      return err;
     }
+  }
+  return err;
+}
+
+/* the program is cut into chunks of this many ops, which get compiled on their
+ * own. a cut can fall inside a loop, as long as no cell is in a register
+ * there. the cuts do not depend on the number of threads, so neither does the
+ * code. */
+#define CHUNK_MIN_OPS 0x4000
+
+typedef struct {
+  size_t from, to;
+  compile_ctx code;
+  compile_state_t state;
+  compile_result err;
+} chunk_t;
+
+/* each worker takes chunks off the back of its own share, and once that runs
+ * out, steals from the front of the others' */
+typedef struct {
+  pthread_mutex_t lock;
+  size_t front, back;
+} chunk_deque_t;
+
+typedef struct {
+  ir_ctx *ctx_ir;
+  chunk_t *chunks;
+  chunk_deque_t *deques;
+  size_t workers;
+  size_t id;
+} chunk_worker_t;
 
-    if (opcode.kind == IR_OP_LOOP_END) {
+static int chunk_take(chunk_deque_t *deque, int steal, size_t *chunk) {
+  pthread_mutex_lock(&deque->lock);
+  int found = deque->front < deque->back;
+  if (found)
+    *chunk = steal ? deque->front++ : --deque->back;
+  pthread_mutex_unlock(&deque->lock);
+  return found;
+}
+
+static void *chunk_worker(void *arg) {
+  chunk_worker_t *worker = arg;
+  for (;;) {
+    size_t idx;
+    int found = chunk_take(&worker->deques[worker->id], 0, &idx);
+    for (size_t i = 1; !found && i < worker->workers; i++) {
+      size_t victim = (worker->id + i) % worker->workers;
+      found = chunk_take(&worker->deques[victim], 1, &idx);
+    }
+    if (!found)
+      return NULL;
+    chunk_t *chunk = &worker->chunks[idx];
+    chunk->err = compile_range(&chunk->code, worker->ctx_ir, &chunk->state,
+                               chunk->from, chunk->to, SIZE_MAX);
+  }
+}
+
+/* compiles the chunks over all cores */
+static void compile_chunks(ir_ctx *ctx_ir, chunk_t *chunks, size_t count) {
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  size_t workers = cores < 1 ? 1 : (size_t)cores;
+  if (workers > count)
+    workers = count;
+
+  chunk_deque_t *deques = calloc(workers, sizeof(*deques));
+  chunk_worker_t *pool = calloc(workers, sizeof(*pool));
+  pthread_t *threads = calloc(workers, sizeof(*threads));
+  for (size_t i = 0; i < workers; i++) {
+    pthread_mutex_init(&deques[i].lock, NULL);
+    deques[i].front = count * i / workers;
+    deques[i].back = count * (i + 1) / workers;
+    pool[i] = (chunk_worker_t){ctx_ir, chunks, deques, workers, i};
+  }
+  /* the calling thread is the first worker */
+  size_t started = 1;
+  for (; started < workers; started++) {
+    if (pthread_create(&threads[started], NULL, chunk_worker, &pool[started]))
       break;
+  }
+  chunk_worker(&pool[0]);
+  for (size_t i = 1; i < started; i++)
+    pthread_join(threads[i], NULL);
+
+  for (size_t i = 0; i < workers; i++)
+    pthread_mutex_destroy(&deques[i].lock);
+  free(threads);
+  free(pool);
+  free(deques);
+}
+
+/* compiles [idx, ctx_ir->length) in chunks, then puts their code one after the
+ * other, moving their jumps along */
+static compile_result compile_program(compile_ctx *ctx, ir_ctx *ctx_ir,
+                                      compile_state_t *state, size_t idx) {
+  vec_t(chunk_t) chunks = {0};
+  size_t from = idx;
+  for (size_t i = idx; i < ctx_ir->length; i++) {
+    if (i - from >= CHUNK_MIN_OPS) {
+      vec_push(&chunks, ((chunk_t){.from = from, .to = i}));
+      from = i;
     }
+    ir_op_t op = ir_op_at(ctx_ir, i);
+    if (op.kind != IR_OP_LOOP_START && op.kind != IR_OP_LOOP_ENTER)
+      continue;
+    /* an outlined loop is only a call here, and a loop keeping cells in
+     * registers needs them all the way through */
+    if (op.arg > 0 &&
+        (state->outline[i] || alloc_cell_regs(ctx, ctx_ir, i).count))
+      i += op.arg;
   }
-  return COMPILE_OK;
+  vec_push(&chunks, ((chunk_t){.from = from, .to = ctx_ir->length}));
+
+  vec_for(&chunks, chunk, i) {
+    chunk_t *chunk = &chunks.data[iter.i];
+    chunk->code = (compile_ctx){.layout = ctx->layout};
+    chunk->state = (compile_state_t){.routines = state->routines,
+                                     .outline = state->outline};
+  }
+  if (chunks.length > 1) {
+    compile_chunks(ctx_ir, chunks.data, chunks.length);
+  } else {
+    chunk_t *chunk = &chunks.data[0];
+    chunk->err = compile_range(&chunk->code, ctx_ir, &chunk->state,
+                               chunk->from, chunk->to, SIZE_MAX);
+  }
+
+  compile_result err = COMPILE_OK;
+  vec_for(&chunks, chunk, i) {
+    chunk_t *chunk = &chunks.data[iter.i];
+    if (err == COMPILE_OK)
+      err = chunk->err;
+    if (err == COMPILE_OK) {
+      size_t base = ctx->length, first = state->jumps.length;
+      vec_for(&chunk->state.jumps, jump, j) {
+        jump_t moved = iter.jump;
+        moved.at += base;
+        if (moved.cc != JUMP_CALL)
+          moved.target += base;
+        vec_push(&state->jumps, moved);
+      }
+      /* close the loops the chunks before left open, then leave this one's
+       * open for the chunks after */
+      for (size_t j = 0; j < chunk->state.ends.length; j += 2) {
+        if (state->loops.length < 2) {
+          fprintf(stderr, "compiler error: %s\n",
+                  compile_result_str[COMPILE_MALFORMED_LOOP]);
+          err = COMPILE_MALFORMED_LOOP;
+          break;
+        }
+        size_t body = vec_pop(&state->loops);
+        int64_t test = vec_pop(&state->loops);
+        state->jumps.data[first + chunk->state.ends.data[j]].target = body;
+        if (test >= 0)
+          state->jumps.data[test].target = base + chunk->state.ends.data[j + 1];
+      }
+      for (size_t j = 0; j < chunk->state.loops.length; j += 2) {
+        int64_t test = chunk->state.loops.data[j];
+        vec_push(&state->loops, test < 0 ? -1 : (int64_t)first + test);
+        vec_push(&state->loops, (int64_t)base + chunk->state.loops.data[j + 1]);
+      }
+      vec_extend(&state->called, &chunk->state.called);
+      vec_extend(ctx, &chunk->code);
+    }
+    vec_deinit(&chunk->code);
+    vec_deinit(&chunk->state.jumps);
+    vec_deinit(&chunk->state.loops);
+    vec_deinit(&chunk->state.ends);
+    vec_deinit(&chunk->state.called);
+  }
+  vec_deinit(&chunks);
+  return err;
+}
+
+/* emits the whole program, followed by the loops it calls. loops leave
+ * placeholder jumps behind that get their final encoding once everything is
+ * in place. */
+size_t ir_ctx_compile__(compile_ctx *ctx, ir_ctx *ctx_ir, size_t idx) {
+  compile_state_t state = {0};
+  state.outline = find_routines(ctx_ir, &state.routines);
+
+  compile_result err = compile_program(ctx, ctx_ir, &state, idx);
+  /* the routines come in the order they are first called */
+  for (size_t i = 0; i < state.called.length && err == COMPILE_OK; i++) {
+    routine_t *routine = &state.routines.data[state.called.data[i]];
+    if (routine->at >= 0)
+      continue;
+    routine->at = ctx->length;
+    ctx->peephole = (peephole_t){0};
+    size_t end = routine->idx + ir_op_at(ctx_ir, routine->idx).arg;
+    err = compile_range(ctx, ctx_ir, &state, routine->idx, end + 1,
+                        routine->idx);
+    /* ret */
+    ctx_push_code(ctx, 0xC3);
+  }
+  if (err == COMPILE_OK && (state.loops.length || state.ends.length)) {
+    fprintf(stderr, "compiler error: %s\n",
+            compile_result_str[COMPILE_MALFORMED_LOOP]);
+    err = COMPILE_MALFORMED_LOOP;
+  }
+
+  if (err == COMPILE_OK) {
+    vec_for(&state.jumps, jump, i) {
+      jump_t *jump = &state.jumps.data[iter.i];
+      if (jump->cc == JUMP_CALL)
+        jump->target = state.routines.data[jump->target].at;
+    }
+    relax_jumps(ctx, &state.jumps);
+  }
+  vec_deinit(&state.jumps);
+  vec_deinit(&state.loops);
+  vec_deinit(&state.ends);
+  vec_deinit(&state.routines);
+  vec_deinit(&state.called);
+  free(state.outline);
+  return err;
 }
 
 static const char *ir_compile_dump_asm(ir_op_t opcode, char *buf) {
@@ -374,16 +1623,16 @@ static const char *ir_compile_dump_asm(ir_op_t opcode, char *buf) {
   case IR_OP_CELL:
     if (opcode.arg > 0) {
       if (opcode.arg == 1)
-        written = sprintf(buf, "inc (%s)", reg_names[SP_REG]);
+        written = sprintf(buf, "inc %d(%s)", opcode.off, reg_names[SP_REG]);
       else
-        written =
-            sprintf(buf, "addl $%02lx,(%s)", opcode.arg, reg_names[SP_REG]);
+        written = sprintf(buf, "addl $%02lx,%d(%s)", opcode.arg, opcode.off,
+                          reg_names[SP_REG]);
     } else {
       if (opcode.arg == -1)
-        written = sprintf(buf, "dec (%s)", reg_names[SP_REG]);
+        written = sprintf(buf, "dec %d(%s)", opcode.off, reg_names[SP_REG]);
       else
-        written =
-            sprintf(buf, "sub $%02lx,(%s)", -opcode.arg, reg_names[SP_REG]);
+        written = sprintf(buf, "sub $%02lx,%d(%s)", -opcode.arg, opcode.off,
+                          reg_names[SP_REG]);
     }
     break;
   case IR_OP_TAPE:
@@ -404,6 +1653,13 @@ static const char *ir_compile_dump_asm(ir_op_t opcode, char *buf) {
     written = sprintf(buf, "%s %ld", jmp_table[opcode.kind == IR_OP_LOOP_END],
                       opcode.arg);
     break;
+  case IR_OP_SET:
+    written = sprintf(buf, "movb $%02lx,%d(%s)", opcode.arg & 0xff,
+                      opcode.off, reg_names[SP_REG]);
+    break;
+  case IR_OP_MUL:
+    written = sprintf(buf, "<mul %d,%ld>", opcode.off, opcode.arg);
+    break;
   case IR_OP_MAX:
     written = sprintf(buf, "<exit>");
     break;
@@ -415,8 +1671,11 @@ static const char *ir_compile_dump_asm(ir_op_t opcode, char *buf) {
 }
 
 inline size_t ir_ctx_compile(compile_ctx *ctx, ir_ctx *ctx_ir) {
-  /* patch code to have a halt instruction */
-  vec_push(ctx_ir, ((ir_op_t){.kind = IR_OP_MAX, .arg = 0}));
+  /* patch code to have a halt instruction, unless an earlier run already did */
+  if (!ctx_ir->length || ir_kind_at(ctx_ir, ctx_ir->length - 1) != IR_OP_MAX)
+    ir_op_push(ctx_ir, (ir_op_t){.kind = IR_OP_MAX, .arg = 0});
+  ctx->peephole = (peephole_t){0};
+  ctx->regs.count = 0;
 
 #if 0
   char buf[1024] = {0};
@@ -426,6 +1685,48 @@ inline size_t ir_ctx_compile(compile_ctx *ctx, ir_ctx *ctx_ir) {
   }
 #endif
 
+  /* called as a function, %rbx has to survive */
+  if (ctx->layout->target & TARGET_JIT) {
+    /* push %rbx */
+    ctx_push_code(ctx, 0x50 + REG_EBX);
+  }
+  /* mov $sp, %SP_REG; mov $out_buf, %OUT_REG */
+  ctx_push_code(ctx, 0xb8 + SP_REG);
+  vec_push_as_bytes(ctx, &ctx->layout->sp);
+  ctx_push_code(ctx, 0xb8 + OUT_REG);
+  vec_push_as_bytes(ctx, &ctx->layout->out_buf);
+
+  /* the io routines sit in front of the program, which jumps over them */
+  compile_ctx flush = {.layout = ctx->layout};
+  emit_flush(&flush);
+  ctx_push_code(ctx, 0xEB, (int8_t)flush.length);
+  ctx->layout->flush = ctx->layout->code + ctx->length;
+  vec_extend(ctx, &flush);
+  vec_deinit(&flush);
+  compile_ctx getc = {.layout = ctx->layout};
+  emit_getc(&getc);
+  ctx_push_code(ctx, 0xEB, (int8_t)getc.length);
+  ctx->layout->getc = ctx->layout->code + ctx->length;
+  vec_extend(ctx, &getc);
+  vec_deinit(&getc);
+
+  /* executables report running off the tape, in process it just faults */
+  if (!(ctx->layout->target & TARGET_JIT)) {
+    compile_ctx handler = {.layout = ctx->layout};
+    uint32_t at = ctx->layout->code + ctx->length + 5;
+    uint32_t act = emit_segv_handler(&handler, at);
+    /* jmp imm32 */
+    int32_t skip = handler.length;
+    ctx_push_code(ctx, 0xE9);
+    vec_push_as_bytes(ctx, &skip);
+    vec_extend(ctx, &handler);
+    vec_deinit(&handler);
+    emit_install_guard(ctx, act);
+    /* mov $out_buf, %OUT_REG */
+    ctx_push_code(ctx, 0xb8 + OUT_REG);
+    vec_push_as_bytes(ctx, &ctx->layout->out_buf);
+  }
+
   /* push the location of bss to the stack */
   /* push %SP_REG */
   ctx_push_code(ctx, 0xFF, mod_rm(MODE_REG_DIRECT, 6, SP_REG));
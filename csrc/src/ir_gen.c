@@ -2,113 +2,815 @@
 #include "common.h"
 #include <assert.h>
 #include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 void ir_ctx_free(ir_ctx *ctx) {
-  if (ctx->patch) {
-    fprintf(stderr, "unmatched '['");
+  vec_deinit(&ctx->wide);
+  vec_deinit(ctx);
+}
+
+/* whether the op packs without an escape */
+static int op_fits(ir_op_t op) {
+  return op.off == (int8_t)op.off && op.arg == (int16_t)op.arg;
+}
+
+/* replaces the op at i. an op that was escaped already reuses its slot in the
+ * side table, slots of ops that fit again are left for the next pass to drop */
+void ir_op_put(ir_ctx *ctx, size_t i, ir_op_t op) {
+  ir_code_t *code = &ctx->data[i];
+  if (op_fits(op)) {
+    *code = (ir_code_t){.kind = op.kind, .off = op.off, .arg = op.arg};
+    return;
   }
-  while (ctx->patch) {
-    ir_patch_t *prev = ctx->patch->prev;
-    free(ctx->patch);
-    ctx->patch = prev;
+  size_t slot = ir_code_slot(*code);
+  if (!(code->kind & IR_CODE_ESCAPE)) {
+    assert(ctx->wide.length < IR_CODE_SLOTS);
+    slot = ctx->wide.length;
+    vec_push(&ctx->wide, op);
   }
-  vec_deinit(ctx);
+  ctx->wide.data[slot] = op;
+  *code = (ir_code_t){.kind = op.kind | IR_CODE_ESCAPE,
+                      .off = (int8_t)slot,
+                      .arg = (int16_t)(slot >> 8)};
 }
 
-static uint64_t count_char(const char *src, char c) {
-  const char *ptr = src;
-  while (*(++ptr) == c)
-    ;
-  return (uint64_t)(ptr - src);
+void ir_op_push(ir_ctx *ctx, ir_op_t op) {
+  vec_push(ctx, ((ir_code_t){0}));
+  ir_op_put(ctx, ctx->length - 1, op);
 }
 
-size_t ir_ctx_parse(ir_ctx *ctx, const char *src) {
+static const uint8_t is_command[256] = {
+    ['+'] = 1, ['-'] = 1, ['<'] = 1, ['>'] = 1,
+    ['['] = 1, [']'] = 1, ['.'] = 1, [','] = 1,
+};
+
+#ifdef __SSE2__
+/* the bytes of the 16 from ptr on that are commands */
+static uint32_t command_mask(const char *ptr) {
+  __m128i bytes = _mm_loadu_si128((const __m128i *)ptr);
+  __m128i hits = _mm_setzero_si128();
+  for (const char *c = "+-<>[].,"; *c; c++)
+    hits = _mm_or_si128(hits, _mm_cmpeq_epi8(bytes, _mm_set1_epi8(*c)));
+  return _mm_movemask_epi8(hits);
+}
+#endif
+
+/* skips everything up to the next command, returning end if there is none */
+static const char *skip_comments(const char *ptr, const char *end) {
+  /* in most programs the commands follow each other */
+  if (ptr < end && is_command[(uint8_t)*ptr])
+    return ptr;
+#ifdef __SSE2__
+  for (; end - ptr >= 16; ptr += 16) {
+    uint32_t hits = command_mask(ptr);
+    if (hits)
+      return ptr + __builtin_ctz(hits);
+  }
+#endif
+  while (ptr < end && !is_command[(uint8_t)*ptr])
+    ptr++;
+  return ptr;
+}
+
+/* how many times c repeats from ptr on */
+static uint64_t count_char(const char *ptr, const char *end, char c) {
+  /* most runs are short, so only long ones go 16 bytes at a time */
+  const char *run = ptr;
+  const char *first = end - ptr > 16 ? ptr + 16 : end;
+  while (run < first && *run == c)
+    run++;
+  if (run < first)
+    return run - ptr;
+#ifdef __SSE2__
+  const __m128i wanted = _mm_set1_epi8(c);
+  for (; end - run >= 16; run += 16) {
+    __m128i bytes = _mm_loadu_si128((const __m128i *)run);
+    uint32_t other = ~_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, wanted)) & 0xffff;
+    if (other)
+      return run - ptr + __builtin_ctz(other);
+  }
+#endif
+  while (run < end && *run == c)
+    run++;
+  return run - ptr;
+}
+
+/* adds a run of count to the op before it when that is of the same kind, so
+ * that a run split over two calls to ir_ctx_parse comes out as one op */
+static void push_run(ir_ctx *ctx, ir_op_kind_t kind, int64_t count) {
+  if (ctx->length > 0 && ir_kind_at(ctx, ctx->length - 1) == kind) {
+    ir_op_t op = ir_op_at(ctx, ctx->length - 1);
+    op.arg += count;
+    ir_op_put(ctx, ctx->length - 1, op);
+  } else {
+    ir_op_push(ctx, (ir_op_t){.kind = kind, .arg = count});
+  }
+}
+
+/* parses the next length bytes of the program, which can be split anywhere
+ * over as many calls as it takes */
+size_t ir_ctx_parse(ir_ctx *ctx, const char *src, size_t length) {
+  const char *end = src + length;
   const char *ptr = src;
-  /* } is not significant in macros so we need to wrap struct literals */
-#define push_op(op, v)                                                         \
-  vec_push(ctx, ((ir_op_t){op, v}));                                           \
-  break
-  while (*ptr) {
-    uint64_t count = count_char(ptr, *ptr);
+  while ((ptr = skip_comments(ptr, end)) < end) {
+    uint64_t count = count_char(ptr, end, *ptr);
     switch (*ptr) {
     case ',':
-      push_op(IR_OP_READ, count);
+      push_run(ctx, IR_OP_READ, count);
+      break;
     case '.':
-      push_op(IR_OP_WRITE, count);
-    case '+': {
-      if (ctx->length > 0 && vec_last(ctx).kind == IR_OP_CELL) {
-        vec_last(ctx).arg += count;
-        /* if (vec_last(ctx).arg == 0) */
-        /*   unused(vec_pop(ctx)); */
-        break;
+      push_run(ctx, IR_OP_WRITE, count);
+      break;
+    case '+':
+      push_run(ctx, IR_OP_CELL, count);
+      break;
+    case '-':
+      push_run(ctx, IR_OP_CELL, -count);
+      break;
+    case '>':
+      push_run(ctx, IR_OP_TAPE, count);
+      break;
+    case '<':
+      push_run(ctx, IR_OP_TAPE, -count);
+      break;
+    case '[':
+      for (uint64_t i = 0; i < count; i++) {
+        int64_t outer = ctx->open ? ctx->length + 1 - ctx->open : 0;
+        ir_op_push(ctx, (ir_op_t){.kind = IR_OP_LOOP_START, .arg = outer});
+        ctx->open = ctx->length;
       }
-      push_op(IR_OP_CELL, count);
+      break;
+    case ']':
+      for (uint64_t i = 0; i < count; i++) {
+        if (!ctx->open) {
+          fputs("unmatched ']'", stderr);
+          return 1;
+        }
+        size_t start = ctx->open - 1;
+        int64_t delta = ctx->length - start;
+        int64_t outer = ir_op_at(ctx, start).arg;
+        ctx->open = outer ? start + 1 - outer : 0;
+        ir_op_put(ctx, start,
+                  (ir_op_t){.kind = IR_OP_LOOP_START, .arg = delta});
+        ir_op_push(ctx, (ir_op_t){.kind = IR_OP_LOOP_END, .arg = -delta});
+      }
+      break;
+    }
+    ptr += count;
+  }
+  return 0;
+}
+
+/* recompute the jump deltas of every loop after a pass has moved code around */
+void ir_ctx_link_loops(ir_ctx *ctx) {
+  vec_t(size_t) starts = {0};
+  for (size_t i = 0; i < ctx->length; i++) {
+    ir_op_kind_t kind = ir_kind_at(ctx, i);
+    if (kind == IR_OP_LOOP_START || kind == IR_OP_LOOP_ENTER) {
+      vec_push(&starts, i);
+    } else if (kind == IR_OP_LOOP_END) {
+      size_t start = vec_pop(&starts);
+      int64_t delta = i - start;
+      ir_op_put(ctx, start,
+                (ir_op_t){.kind = ir_kind_at(ctx, start), .arg = delta});
+      ir_op_put(ctx, i, (ir_op_t){.kind = IR_OP_LOOP_END, .arg = -delta});
+    }
+  }
+  vec_deinit(&starts);
+}
+
+/* passes build a fresh copy of the code, then swap it in */
+static void ir_ctx_replace(ir_ctx *ctx, ir_ctx *code) {
+  vec_deinit(&ctx->wide);
+  vec_deinit(ctx);
+  *ctx = *code;
+  ir_ctx_link_loops(ctx);
+}
+
+typedef struct {
+  int32_t off;
+  int64_t delta;
+} cell_delta_t;
+
+typedef vec_t(cell_delta_t) cell_delta_vec_t;
+
+/* collects the net change of every cell touched by the loop starting at idx.
+ * returns the change of the cell the loop tests if the body is made of only
+ * cell and tape ops and the tape ends up where it started, and 0 otherwise.
+ * on a tape of cells, offsets that far apart can be the same cell, so such
+ * loops are left alone too. */
+static int64_t loop_cell_deltas(ir_ctx *ctx, size_t idx, size_t cells,
+                                cell_delta_vec_t *deltas) {
+  int32_t off = 0, lo = 0, hi = 0;
+  vec_clear(deltas);
+  vec_push(deltas, ((cell_delta_t){.off = 0, .delta = 0}));
+  size_t end = idx + ir_op_at(ctx, idx).arg;
+  for (size_t i = idx + 1; i < end; i++) {
+    ir_op_t opcode = ir_op_at(ctx, i);
+    if (opcode.kind == IR_OP_TAPE) {
+      off += opcode.arg;
+    } else if (opcode.kind == IR_OP_CELL) {
+      lo = off < lo ? off : lo;
+      hi = off > hi ? off : hi;
+      if ((size_t)(hi - lo) >= cells)
+        return 0;
+      size_t j = 0;
+      while (j < deltas->length && deltas->data[j].off != off)
+        j++;
+      if (j == deltas->length)
+        vec_push(deltas, ((cell_delta_t){.off = off, .delta = 0}));
+      deltas->data[j].delta += opcode.arg;
+    } else {
+      return 0;
+    }
+  }
+  return off == 0 ? vec_first(deltas).delta : 0;
+}
+
+/* turn loops that move the value of a cell into others, e.g. [->+>++<<],
+ * into a run of multiply-adds followed by clearing the cell */
+void ir_pass_mul_loops(ir_ctx *ctx, size_t cells) {
+  ir_ctx code = {0};
+  cell_delta_vec_t deltas = {0};
+  vec_reserve(&code, ctx->length);
+
+  for (size_t i = 0; i < ctx->length; i++) {
+    ir_op_t opcode = ir_op_at(ctx, i);
+    int64_t step = 0;
+    if (opcode.kind == IR_OP_LOOP_START)
+      step = loop_cell_deltas(ctx, i, cells, &deltas);
+    if (step != 1 && step != -1) {
+      ir_op_push(&code, opcode);
+      continue;
+    }
+
+    /* the loop runs cell times when counting down, and -cell times (mod the
+     * cell size) when counting up, so flip the factors in the latter case */
+    vec_for(&deltas, cell, j) {
+      if (iter.cell.off == 0 || iter.cell.delta == 0)
+        continue;
+      ir_op_push(&code, (ir_op_t){.kind = IR_OP_MUL,
+                                  .off = iter.cell.off,
+                                  .arg = -step * iter.cell.delta});
     }
-    case '-': {
-      if (ctx->length > 0 && vec_last(ctx).kind == IR_OP_CELL) {
-        vec_last(ctx).arg -= count;
-        /* if (vec_last(ctx).arg == 0) */
-        /*   unused(vec_pop(ctx)); */
+    ir_op_push(&code, (ir_op_t){.kind = IR_OP_SET, .arg = 0});
+    i += opcode.arg;
+  }
+
+  vec_deinit(&deltas);
+  ir_ctx_replace(ctx, &code);
+}
+
+/* turn loops that only move the tape, e.g. [>] or [<<], into scans */
+void ir_pass_scan_loops(ir_ctx *ctx) {
+  ir_ctx code = {0};
+  vec_reserve(&code, ctx->length);
+
+  for (size_t i = 0; i < ctx->length; i++) {
+    ir_op_t opcode = ir_op_at(ctx, i);
+    if (opcode.kind == IR_OP_LOOP_START && opcode.arg == 2 &&
+        ir_kind_at(ctx, i + 1) == IR_OP_TAPE && ir_op_at(ctx, i + 1).arg != 0) {
+      ir_op_push(&code, (ir_op_t){.kind = IR_OP_SCAN,
+                                  .arg = ir_op_at(ctx, i + 1).arg});
+      i += opcode.arg;
+      continue;
+    }
+    ir_op_push(&code, opcode);
+  }
+
+  ir_ctx_replace(ctx, &code);
+}
+
+/* fold tape moves into the offsets of the ops that follow them, so that the
+ * tape pointer only has to be moved before the tests of a loop */
+void ir_pass_fold_offsets(ir_ctx *ctx) {
+  ir_ctx code = {0};
+  int32_t off = 0;
+  vec_reserve(&code, ctx->length);
+
+  for (size_t i = 0; i < ctx->length; i++) {
+    ir_op_t op = ir_op_at(ctx, i);
+    switch (op.kind) {
+    case IR_OP_TAPE:
+      off += op.arg;
+      continue;
+    case IR_OP_MUL:
+      /* a run of muls reads the cell under the tape pointer */
+      if (i > 0 && ir_kind_at(ctx, i - 1) == IR_OP_MUL)
         break;
+      /* fall through */
+    case IR_OP_LOOP_START:
+    case IR_OP_LOOP_END:
+    case IR_OP_SCAN:
+      if (off != 0)
+        ir_op_push(&code, (ir_op_t){.kind = IR_OP_TAPE, .arg = off});
+      off = 0;
+      break;
+    case IR_OP_CELL:
+      op.off = off;
+      if (op.arg == 0)
+        continue;
+      if (code.length > 0) {
+        ir_op_t last = ir_op_at(&code, code.length - 1);
+        if (last.kind == IR_OP_CELL && last.off == off) {
+          last.arg += op.arg;
+          if (last.arg == 0)
+            unused(vec_pop(&code));
+          else
+            ir_op_put(&code, code.length - 1, last);
+          continue;
+        }
       }
-      push_op(IR_OP_CELL, -count);
+      break;
+    default:
+      op.off = off;
+      break;
     }
-    case '>': {
-      if (ctx->length > 0 && vec_last(ctx).kind == IR_OP_TAPE) {
-        vec_last(ctx).arg += count;
-        /* if (vec_last(ctx).arg == 0) */
-        /*   unused(vec_pop(ctx)); */
-        break;
+    ir_op_push(&code, op);
+  }
+
+  ir_ctx_replace(ctx, &code);
+}
+
+/* the values of cells of the given width */
+#define cell_mask(bits) ((1ull << (bits)) - 1)
+#define CELL_UNKNOWN -1
+
+/* what is known about the cells of the tape. positions are relative to where
+ * the pass started, and cells outside of the window are either all zero or
+ * all unknown. the window stays shorter than the tape, as positions a whole
+ * tape apart are the same cell. */
+typedef struct {
+  vec_t(int64_t);
+  int64_t lo; /* position of the first cell in the window */
+  int64_t sp; /* position of the tape pointer */
+  int zeroed;
+  size_t cells; /* on the tape */
+} tape_state_t;
+
+typedef vec_t(int32_t) offset_vec_t;
+
+/* whether the window would get as long as the tape if it took in pos */
+static int tape_laps(tape_state_t *tape, int64_t pos) {
+  int64_t lo = pos < tape->lo ? pos : tape->lo;
+  int64_t end = tape->lo + (int64_t)tape->length;
+  int64_t hi = pos >= end ? pos : end - 1;
+  return tape->length && (uint64_t)(hi - lo) >= tape->cells;
+}
+
+/* forget everything, e.g. after the tape pointer moved by an unknown amount */
+static void tape_forget(tape_state_t *tape) {
+  vec_clear(tape);
+  tape->zeroed = 0;
+}
+
+static int64_t tape_get(tape_state_t *tape, int32_t off) {
+  int64_t pos = tape->sp + off;
+  if (pos < tape->lo || pos >= tape->lo + (int64_t)tape->length)
+    return tape->zeroed && !tape_laps(tape, pos) ? 0 : CELL_UNKNOWN;
+  return tape->data[pos - tape->lo];
+}
+
+static void tape_set(tape_state_t *tape, int32_t off, int64_t value) {
+  int64_t pos = tape->sp + off;
+  if (tape_laps(tape, pos))
+    tape_forget(tape);
+  int64_t outside = tape->zeroed ? 0 : CELL_UNKNOWN;
+  if (tape->length == 0)
+    tape->lo = pos;
+  if (pos < tape->lo) {
+    size_t count = tape->lo - pos;
+    vec_reserve_po2_(vec_unpack_(tape), tape->length + count);
+    memmove(tape->data + count, tape->data, tape->length * sizeof(int64_t));
+    for (size_t i = 0; i < count; i++)
+      tape->data[i] = outside;
+    tape->length += count;
+    tape->lo = pos;
+  }
+  while (pos >= tape->lo + (int64_t)tape->length)
+    vec_push(tape, outside);
+  tape->data[pos - tape->lo] = value;
+}
+
+/* collects the offsets of the cells written by the loop at idx. returns
+ * whether the loop is balanced, i.e. whether it always leaves the tape pointer
+ * where it found it, as otherwise it could write anywhere. */
+static int loop_writes(ir_ctx *ctx, size_t idx, offset_vec_t *writes) {
+  offset_vec_t starts = {0};
+  int32_t pos = 0;
+  int balanced = 1;
+  vec_clear(writes);
+  size_t end = idx + ir_op_at(ctx, idx).arg;
+  for (size_t i = idx + 1; balanced && i < end; i++) {
+    ir_op_t opcode = ir_op_at(ctx, i);
+    switch (opcode.kind) {
+    case IR_OP_TAPE:
+      pos += opcode.arg;
+      break;
+    case IR_OP_CELL:
+    case IR_OP_SET:
+    case IR_OP_READ:
+    case IR_OP_MUL:
+      vec_push(writes, pos + opcode.off);
+      break;
+    case IR_OP_LOOP_START:
+    case IR_OP_LOOP_ENTER:
+      vec_push(&starts, pos);
+      break;
+    case IR_OP_LOOP_END:
+      balanced = vec_pop(&starts) == pos;
+      break;
+    case IR_OP_SCAN:
+      balanced = 0;
+      break;
+    default:
+      break;
+    }
+  }
+  vec_deinit(&starts);
+  return balanced && pos == 0;
+}
+
+/* the cells a loop writes are unknown on every pass through it */
+static void tape_forget_loop(tape_state_t *tape, ir_ctx *ctx, size_t idx,
+                             offset_vec_t *writes) {
+  if (!loop_writes(ctx, idx, writes)) {
+    tape_forget(tape);
+    return;
+  }
+  vec_for(writes, off, i) { tape_set(tape, iter.off, CELL_UNKNOWN); }
+}
+
+/* track the value of cells through the program, which starts with an all zero
+ * tape. cell updates of known cells become sets, loops and scans that start
+ * on a zero cell are dropped, and loops that start on a nonzero cell don't
+ * need to test it when entering. */
+void ir_pass_const_cells(ir_ctx *ctx, int cell_bits, size_t cells) {
+  uint64_t mask = cell_mask(cell_bits);
+  ir_ctx code = {0};
+  tape_state_t tape = {.zeroed = 1, .cells = cells};
+  offset_vec_t writes = {0};
+  vec_t(size_t) loops = {0};
+  vec_reserve(&code, ctx->length);
+
+  for (size_t i = 0; i < ctx->length; i++) {
+    ir_op_t op = ir_op_at(ctx, i);
+    int64_t value = op.kind == IR_OP_TAPE ? 0 : tape_get(&tape, op.off);
+    switch (op.kind) {
+    case IR_OP_TAPE:
+      tape.sp += op.arg;
+      break;
+    case IR_OP_CELL:
+      if (value != CELL_UNKNOWN) {
+        op = (ir_op_t){.kind = IR_OP_SET,
+                       .off = op.off,
+                       .arg = (value + op.arg) & mask};
+        tape_set(&tape, op.off, op.arg);
+      }
+      break;
+    case IR_OP_SET:
+      op.arg &= mask;
+      if (value == op.arg)
+        continue;
+      tape_set(&tape, op.off, op.arg);
+      break;
+    case IR_OP_READ:
+      tape_set(&tape, op.off, CELL_UNKNOWN);
+      break;
+    case IR_OP_MUL: {
+      int64_t src = tape_get(&tape, 0);
+      if (src == 0)
+        continue;
+      if (src != CELL_UNKNOWN && value != CELL_UNKNOWN) {
+        op = (ir_op_t){.kind = IR_OP_SET,
+                       .off = op.off,
+                       .arg = (value + (uint64_t)op.arg * src) & mask};
+        tape_set(&tape, op.off, op.arg);
+      } else if (src != CELL_UNKNOWN) {
+        op = (ir_op_t){.kind = IR_OP_CELL, .off = op.off, .arg = op.arg * src};
+      } else {
+        tape_set(&tape, op.off, CELL_UNKNOWN);
       }
-      push_op(IR_OP_TAPE, count);
+      break;
     }
-    case '<': {
-      if (ctx->length > 0 && vec_last(ctx).kind == IR_OP_TAPE) {
-        vec_last(ctx).arg -= count;
-        /* if (vec_last(ctx).arg == 0) */
-        /*   unused(vec_pop(ctx)); */
-        break;
+    case IR_OP_SCAN:
+      if (value == 0)
+        continue;
+      tape_forget(&tape);
+      tape_set(&tape, 0, 0);
+      break;
+    case IR_OP_LOOP_START:
+      if (value == 0) {
+        i += op.arg;
+        continue;
       }
-      push_op(IR_OP_TAPE, -count);
-    }
-#undef push_op
-    case '[': {
-      ir_patch_t *next = calloc(1, sizeof(ir_patch_t));
-      *next = (ir_patch_t){.addr = ctx->length, .prev = ctx->patch};
-      ctx->patch = next;
-      vec_push(ctx, ((ir_op_t){.kind = IR_OP_LOOP_START, .arg = 0}));
-      ptr++;
-      continue;
+      if (value != CELL_UNKNOWN)
+        op.kind = IR_OP_LOOP_ENTER;
+      tape_forget_loop(&tape, ctx, i, &writes);
+      vec_push(&loops, code.length);
+      break;
+    case IR_OP_LOOP_END:
+      /* a loop that may not have run at all leaves its cells unknown */
+      if (ir_kind_at(&code, vec_pop(&loops)) == IR_OP_LOOP_START)
+        tape_forget_loop(&tape, ctx, i + op.arg, &writes);
+      tape_set(&tape, 0, 0);
+      break;
+    default:
+      break;
     }
-    case ']': {
-      if (ctx->patch) {
-        int64_t delta = ctx->length - ctx->patch->addr;
-        ctx->data[ctx->patch->addr] =
-            (ir_op_t){.kind = IR_OP_LOOP_START, .arg = delta};
-        vec_push(ctx, ((ir_op_t){.kind = IR_OP_LOOP_END, .arg = -delta}));
-        ir_patch_t *tmp = ctx->patch->prev;
-        free(ctx->patch);
-        ctx->patch = tmp;
-        ptr++;
+    ir_op_push(&code, op);
+  }
+
+  vec_deinit(&loops);
+  vec_deinit(&writes);
+  vec_deinit(&tape);
+  ir_ctx_replace(ctx, &code);
+}
+
+#define VEC_LANES 8
+/* fewer updates than this are cheaper done one by one */
+#define VEC_MIN_LANES 4
+/* runs of zeroed cells at least this long become clears */
+#define CLEAR_MIN_CELLS 16
+
+/* the combined effect of a run of cell and set ops on one cell */
+typedef struct {
+  int32_t off;
+  int is_set;
+  int64_t arg; /* what gets added, or what the cell is set to */
+  size_t seq;  /* where it was in the run */
+} cell_update_t;
+
+typedef vec_t(cell_update_t) cell_update_vec_t;
+
+static int compare_update(const void *a, const void *b) {
+  const cell_update_t *x = a, *y = b;
+  if (x->off != y->off)
+    return (x->off > y->off) - (x->off < y->off);
+  return (x->seq > y->seq) - (x->seq < y->seq);
+}
+
+/* emits what the run of updates does, with updates to neighbouring cells
+ * grouped into vector ops. the vector ops other than clears work on bytes, so
+ * they only come up with 8 bit cells. the current cell comes last, so that a
+ * loop test right after can use the flags it leaves behind. */
+static void emit_cell_updates(ir_ctx *code, cell_update_vec_t *run,
+                              int cell_bits) {
+  uint64_t mask = cell_mask(cell_bits);
+  qsort(run->data, run->length, sizeof(*run->data), compare_update);
+  /* merge the updates of each cell, in the order they happened */
+  size_t count = 0;
+  vec_for(run, update, i) {
+    cell_update_t *last = count ? &run->data[count - 1] : NULL;
+    if (!last || last->off != iter.update.off)
+      run->data[count++] = iter.update;
+    else if (iter.update.is_set)
+      *last = iter.update;
+    else
+      last->arg += iter.update.arg;
+  }
+  run->length = count;
+
+  ir_op_t current = {.kind = IR_OP_MAX};
+  for (size_t i = 0; i < run->length; i++) {
+    cell_update_t *update = &run->data[i];
+    if (update->seq == SIZE_MAX)
+      continue;
+    ir_op_t op = {.kind = update->is_set ? IR_OP_SET : IR_OP_CELL,
+                  .off = update->off,
+                  .arg = update->arg};
+    if (update->is_set) {
+      size_t zeros = 0, sets = 0;
+      while (i + zeros < run->length && run->data[i + zeros].is_set &&
+             !(run->data[i + zeros].arg & mask) &&
+             run->data[i + zeros].off == update->off + (int32_t)zeros)
+        zeros++;
+      while (i + sets < run->length && sets < VEC_LANES &&
+             run->data[i + sets].is_set &&
+             run->data[i + sets].off == update->off + (int32_t)sets)
+        sets++;
+      if (zeros >= CLEAR_MIN_CELLS) {
+        op = (ir_op_t){.kind = IR_OP_CLEAR, .off = update->off, .arg = zeros};
+        i += zeros - 1;
+      } else if (sets == VEC_LANES && cell_bits == 8) {
+        op = (ir_op_t){.kind = IR_OP_VSET, .off = update->off};
+        for (size_t j = 0; j < VEC_LANES; j++)
+          op.arg |= (uint64_t)(run->data[i + j].arg & mask) << (8 * j);
+        i += VEC_LANES - 1;
+      }
+    } else {
+      /* the adds among the next VEC_LANES cells, sets are left be. the lanes
+       * stay between the first and last cells of the run, which are on the
+       * tape if the program is, so they are pulled back from the end. */
+      int32_t from = update->off, last = vec_last(run).off;
+      if (last - from < VEC_LANES - 1)
+        from = last - (VEC_LANES - 1);
+      size_t lanes = 0, end = i;
+      for (; end < run->length && run->data[end].off < from + VEC_LANES; end++)
+        lanes += !run->data[end].is_set && run->data[end].seq != SIZE_MAX;
+      if (lanes >= VEC_MIN_LANES && cell_bits == 8 &&
+          from >= run->data[0].off) {
+        op = (ir_op_t){.kind = IR_OP_VADD, .off = from};
+        for (size_t j = i; j < end; j++) {
+          cell_update_t *lane = &run->data[j];
+          if (lane->is_set || lane->seq == SIZE_MAX)
+            continue;
+          int shift = 8 * (lane->off - from);
+          op.arg |= (uint64_t)(lane->arg & mask) << shift;
+          lane->seq = SIZE_MAX;
+        }
+      } else if (op.arg == 0) {
         continue;
-      } else {
-        fputs("unmatched ']'", stderr);
-        return 1;
       }
     }
+    if (op.off == 0 && (op.kind == IR_OP_CELL || op.kind == IR_OP_SET))
+      current = op;
+    else
+      ir_op_push(code, op);
+  }
+  if (current.kind != IR_OP_MAX)
+    ir_op_push(code, current);
+  vec_clear(run);
+}
+
+/* replace runs of cell updates, e.g. from +>++>+++>[-]>[-], with their
+ * combined effect, using vector ops where they cover enough cells. a run ends
+ * before it would span the whole tape, where the same cell can come up under
+ * two offsets. */
+void ir_pass_vector_cells(ir_ctx *ctx, int cell_bits, size_t cells) {
+  ir_ctx code = {0};
+  cell_update_vec_t run = {0};
+  int32_t lo = 0, hi = 0;
+  vec_reserve(&code, ctx->length);
+
+  for (size_t i = 0; i < ctx->length; i++) {
+    ir_op_t op = ir_op_at(ctx, i);
+    if (op.kind == IR_OP_CELL || op.kind == IR_OP_SET) {
+      if (!run.length || op.off < lo)
+        lo = op.off;
+      if (!run.length || op.off > hi)
+        hi = op.off;
+      if ((size_t)(hi - lo) >= cells) {
+        emit_cell_updates(&code, &run, cell_bits);
+        lo = hi = op.off;
+      }
+      vec_push(&run, ((cell_update_t){.off = op.off,
+                                      .is_set = op.kind == IR_OP_SET,
+                                      .arg = op.arg,
+                                      .seq = run.length}));
+      continue;
     }
-    ptr += count;
+    emit_cell_updates(&code, &run, cell_bits);
+    ir_op_push(&code, op);
   }
-  return 0;
+  emit_cell_updates(&code, &run, cell_bits);
+
+  vec_deinit(&run);
+  ir_ctx_replace(ctx, &code);
+}
+
+/* cell_bits is how wide the cells of the tape are, 8, 16 or 32, and cells how
+ * many there are when the tape is a ring */
+void ir_ctx_optimize(ir_ctx *ctx, int cell_bits, size_t cells) {
+  /* the passes expect every loop to be matched */
+  if (ctx->open)
+    return;
+  ir_pass_mul_loops(ctx, cells);
+  ir_pass_scan_loops(ctx);
+  ir_pass_fold_offsets(ctx);
+  ir_pass_const_cells(ctx, cell_bits, cells);
+  ir_pass_vector_cells(ctx, cell_bits, cells);
+}
+
+/* appends the ops [from, to) of ctx to code */
+static void copy_ops(ir_ctx *code, ir_ctx *ctx, size_t from, size_t to) {
+  for (size_t i = from; i < to; i++)
+    ir_op_push(code, ir_op_at(ctx, i));
+}
+
+/* builds the program that carries on from the op at ip as if execution had just
+ * got there. the rest of each enclosing loop's body is followed by a copy of
+ * the whole loop, which goes round again if its cell is still set. */
+void ir_ctx_resume(ir_ctx *ctx, size_t ip, ir_ctx *code) {
+  vec_t(size_t) loops = {0};
+  for (size_t i = 0; i < ip; i++) {
+    ir_op_kind_t kind = ir_kind_at(ctx, i);
+    if (kind == IR_OP_LOOP_START || kind == IR_OP_LOOP_ENTER)
+      vec_push(&loops, i);
+    else if (kind == IR_OP_LOOP_END)
+      loops.length--;
+  }
+
+  size_t from = ip;
+  while (loops.length) {
+    size_t start = vec_pop(&loops);
+    size_t end = start + ir_op_at(ctx, start).arg;
+    copy_ops(code, ctx, from, end);
+    /* the cell may well be zero by now */
+    ir_op_push(code, (ir_op_t){.kind = IR_OP_LOOP_START});
+    copy_ops(code, ctx, start + 1, end + 1);
+    from = end + 1;
+  }
+  copy_ops(code, ctx, from, ctx->length);
+  vec_deinit(&loops);
+  ir_ctx_link_loops(code);
 }
 
 #define putcc(c, count)                                                        \
   for (int j = 0; j < count; j++)                                              \
   putchar(c)
 
+static void putmove(int32_t off) {
+  if (off < 0) {
+    putcc('<', -off);
+  } else {
+    putcc('>', off);
+  }
+}
+
+/* a loop still being walked by ir_ctx_tape_range */
+typedef struct {
+  int64_t start; /* where the tape pointer was at the loop test */
+  int balanced;  /* nothing in it so far moves by an unknown amount */
+} range_loop_t;
+
+static inline void use_cells(ir_tape_range_t *range, int64_t from,
+                             int64_t count) {
+  if (from < range->min)
+    range->min = from;
+  if (from + count - 1 > range->max)
+    range->max = from + count - 1;
+}
+
+/* walks the program as if every loop ran once, which visits every op where it
+ * would run as long as the loops are balanced */
+ir_tape_range_t ir_ctx_tape_range(ir_ctx *ctx) {
+  ir_tape_range_t range = {.known = 1};
+  vec_t(range_loop_t) loops = {0};
+  int64_t pos = 0;
+
+  for (size_t i = 0; i < ctx->length; i++) {
+    ir_op_t op = ir_op_at(ctx, i);
+    switch (op.kind) {
+    case IR_OP_TAPE:
+      pos += op.arg;
+      break;
+    case IR_OP_LOOP_START:
+    case IR_OP_LOOP_ENTER:
+      use_cells(&range, pos, 1);
+      vec_push(&loops, ((range_loop_t){.start = pos, .balanced = 1}));
+      break;
+    case IR_OP_LOOP_END: {
+      use_cells(&range, pos, 1);
+      if (!loops.length)
+        break;
+      range_loop_t loop = vec_pop(&loops);
+      if (loop.balanced && loop.start == pos) {
+        range.balanced++;
+        break;
+      }
+      range.unbalanced++;
+      range.known = 0;
+      if (loops.length)
+        vec_last(&loops).balanced = 0;
+      break;
+    }
+    case IR_OP_SCAN:
+      use_cells(&range, pos, 1);
+      range.known = 0;
+      if (loops.length)
+        vec_last(&loops).balanced = 0;
+      break;
+    case IR_OP_MUL:
+      use_cells(&range, pos, 1);
+      use_cells(&range, pos + op.off, 1);
+      break;
+    case IR_OP_VADD:
+    case IR_OP_VSET:
+      use_cells(&range, pos + op.off, 8);
+      break;
+    case IR_OP_CLEAR:
+      use_cells(&range, pos + op.off, op.arg);
+      break;
+    case IR_OP_MAX:
+      break;
+    default:
+      use_cells(&range, pos + op.off, 1);
+      break;
+    }
+  }
+  vec_deinit(&loops);
+  return range;
+}
+
 void ir_ctx_dump_bf(ir_ctx *ctx) {
   for (uint64_t i = 0; i < ctx->length; i++) {
-    ir_op_t opcode = ctx->data[i];
+    ir_op_t opcode = ir_op_at(ctx, i);
+    /* a run of muls is a single loop, so the targets are relative to it */
+    int32_t off = opcode.kind == IR_OP_MUL ? 0 : opcode.off;
+    putmove(off);
     switch (opcode.kind & IR_OP_MAX) {
     case IR_OP_READ:
       putcc(',', opcode.arg);
@@ -133,14 +835,56 @@ void ir_ctx_dump_bf(ir_ctx *ctx) {
       break;
     }
     case IR_OP_LOOP_START:
+    case IR_OP_LOOP_ENTER:
       putchar('[');
       break;
     case IR_OP_LOOP_END:
       putchar(']');
       break;
+    case IR_OP_SET:
+      printf("[-]");
+      putcc('+', (uint8_t)opcode.arg);
+      break;
+    case IR_OP_MUL: {
+      /* a run of muls is a single loop that the following set closes */
+      if (i == 0 || ir_kind_at(ctx, i - 1) != IR_OP_MUL)
+        printf("[-");
+      putmove(opcode.off);
+      if (opcode.arg < 0) {
+        putcc('-', -opcode.arg);
+      } else {
+        putcc('+', opcode.arg);
+      }
+      putmove(-opcode.off);
+      if (i + 1 == ctx->length || ir_kind_at(ctx, i + 1) != IR_OP_MUL)
+        putchar(']');
+      break;
+    }
+    case IR_OP_SCAN:
+      putchar('[');
+      putmove(opcode.arg);
+      putchar(']');
+      break;
+    case IR_OP_VADD:
+    case IR_OP_VSET:
+      for (int lane = 0; lane < 8; lane++) {
+        uint8_t value = opcode.arg >> (8 * lane);
+        if (opcode.kind == IR_OP_VSET)
+          printf("[-]");
+        putcc('+', value);
+        putchar('>');
+      }
+      putmove(-8);
+      break;
+    case IR_OP_CLEAR:
+      for (int64_t cell = 0; cell < opcode.arg; cell++)
+        printf("[-]>");
+      putmove(-opcode.arg);
+      break;
     default:
       putcc('#', opcode.arg);
     }
+    putmove(-off);
   }
   puts("");
 }
@@ -150,17 +894,20 @@ const char *ir_fmt_op(ir_op_t opcode, char *buf) {
   static const char *add_sub[2] = {"add", "sub"};
   static const char *jmp_table[2] = {"jz", "jnz"};
   const int64_t abs_table[2] = {opcode.arg, -opcode.arg};
+  char cell[32] = "[$tape]";
+  if (opcode.off)
+    sprintf(cell, "[$tape%+d]", opcode.off);
 
   size_t written = 0;
   switch (opcode.kind & IR_OP_MAX) {
   case IR_OP_READ:
-    written = sprintf(buf, "read %ld", opcode.arg);
+    written = sprintf(buf, "read %s %ld", cell, opcode.arg);
     break;
   case IR_OP_WRITE:
-    written = sprintf(buf, "write %ld", opcode.arg);
+    written = sprintf(buf, "write %s %ld", cell, opcode.arg);
     break;
   case IR_OP_CELL:
-    written = sprintf(buf, "%s [$tape] %ld", add_sub[opcode.arg < 0],
+    written = sprintf(buf, "%s %s %ld", add_sub[opcode.arg < 0], cell,
                       abs_table[opcode.arg < 0]);
     break;
   case IR_OP_TAPE:
@@ -172,6 +919,45 @@ const char *ir_fmt_op(ir_op_t opcode, char *buf) {
     written = sprintf(buf, "%s %ld", jmp_table[opcode.kind == IR_OP_LOOP_END],
                       opcode.arg);
     break;
+  case IR_OP_SET:
+    written = sprintf(buf, "set %s %ld", cell, opcode.arg);
+    break;
+  case IR_OP_MUL:
+    written = sprintf(buf, "mul %s [$tape] %ld", cell, opcode.arg);
+    break;
+  case IR_OP_SCAN:
+    written = sprintf(buf, "scan $tape %ld", opcode.arg);
+    break;
+  case IR_OP_LOOP_ENTER:
+    written = sprintf(buf, "enter %ld", opcode.arg);
+    break;
+  case IR_OP_VADD:
+    written = sprintf(buf, "vadd %s 0x%016lx", cell, opcode.arg);
+    break;
+  case IR_OP_VSET:
+    written = sprintf(buf, "vset %s 0x%016lx", cell, opcode.arg);
+    break;
+  case IR_OP_CLEAR:
+    written = sprintf(buf, "clear %s %ld", cell, opcode.arg);
+    break;
+  case IR_OP_TAPE_LOOP_END:
+  case IR_OP_TAPE_MUL:
+  case IR_OP_MUL_SET:
+  case IR_OP_SET_TAPE:
+  case IR_OP_CELL_TAPE:
+  case IR_OP_LOOP_START_TAPE: {
+    /* the op the superinstruction starts with, marked as running on into the
+     * next one */
+    static const ir_op_kind_t first[] = {
+        [IR_OP_TAPE_LOOP_END] = IR_OP_TAPE, [IR_OP_TAPE_MUL] = IR_OP_TAPE,
+        [IR_OP_MUL_SET] = IR_OP_MUL,        [IR_OP_SET_TAPE] = IR_OP_SET,
+        [IR_OP_CELL_TAPE] = IR_OP_CELL,     [IR_OP_LOOP_START_TAPE] = IR_OP_LOOP_START,
+    };
+    opcode.kind = first[opcode.kind];
+    written = strlen(ir_fmt_op(opcode, buf));
+    written += sprintf(buf + written, " +");
+    break;
+  }
   case IR_OP_MAX:
     written = sprintf(buf, "halt");
     break;
@@ -185,7 +971,14 @@ const char *ir_fmt_op(ir_op_t opcode, char *buf) {
 void ir_ctx_dump_ir(ir_ctx *ctx) {
   char buf[1024] = {0};
   /* for (uint64_t i = 0; i < ctx->len; i++) { */
-  vec_for(ctx, opcode, i) {
-    printf("[%zu] %s\n", iter.i, ir_fmt_op(iter.opcode, buf));
-  }
+  for (size_t i = 0; i < ctx->length; i++)
+    printf("[%zu] %s\n", i, ir_fmt_op(ir_op_at(ctx, i), buf));
+
+  ir_tape_range_t range = ir_ctx_tape_range(ctx);
+  printf("; loops: %zu balanced, %zu unbalanced\n", range.balanced,
+         range.unbalanced);
+  if (range.known)
+    printf("; tape: cells %ld to %ld\n", range.min, range.max);
+  else
+    printf("; tape: not known until run time\n");
 }
@@ -1,75 +1,661 @@
+#define _GNU_SOURCE /* memfd_create */
 #include "ir_interpret.h"
 #include "common.h"
+#include <errno.h>
+#include <stdio.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
-size_t ir_interpret(ir_ctx *ir_ctx, interpret_ctx_t *ctx) {
-  /* patch code to have a halt instruction */
-  vec_push(ir_ctx, ((ir_op_t){.kind = IR_OP_MAX, .arg = 0}));
-  static void *dispatch_table[] = {
-      [IR_OP_TAPE] = &&ir_op_tape,
-      [IR_OP_CELL] = &&ir_op_cell,
-      [IR_OP_LOOP_START] = &&ir_op_loop_start,
-      [IR_OP_LOOP_END] = &&ir_op_loop_end,
-      [IR_OP_WRITE] = &&ir_op_write,
-      [IR_OP_READ] = &&ir_op_read,
-      [IR_OP_SET] = &&ir_op_set,
-      [IR_OP_MAX] = &&ir_op_halt,
-  };
-  size_t ip = 0;
-  ssize_t sp = 0;
-  char buf[1024] = {0};
-#define opcode(ir_op_ip) ir_ctx->data[ir_op_ip]
-#define dispatch(label, blk)                                                   \
-  label : {                                                                    \
-    if (0) {                                                                   \
-      printf("[%8ld;%8ld] %s\n", ip, sp, ir_fmt_op(opcode(ip), buf));          \
-    } else {                                                                   \
-      unused(buf);                                                             \
+/* sp always stays on the tape, so most cells need no wrap at all, which a
+ * single unsigned compare catches on both sides. the rest can be any number
+ * of laps away on a small tape. */
+static inline size_t tape_wrap(ssize_t cell, size_t capacity) {
+  if ((size_t)cell < capacity)
+    return cell;
+  ssize_t rem = cell % (ssize_t)capacity;
+  return rem < 0 ? (size_t)rem + capacity : (size_t)rem;
+}
+
+#ifdef __SSE2__
+/* bits of a 16 byte compare mask that land on every stride'th cell */
+static const uint16_t stride_mask[] = {
+    [1] = 0xffff, [2] = 0x5555, [4] = 0x1111, [8] = 0x0101};
+#endif
+
+/* finds the first zero cell at sp, sp + stride, ... before the end of the tape,
+ * returning -1 if there is none */
+static ssize_t scan_right8(const uint8_t *tape, size_t sp, size_t stride,
+                           size_t capacity) {
+  if (stride == 1) {
+    const uint8_t *zero = memchr(tape + sp, 0, capacity - sp);
+    return zero ? zero - tape : -1;
+  }
+#ifdef __SSE2__
+  if (stride <= 8 && stride_mask[stride]) {
+    const __m128i zero = _mm_setzero_si128();
+    for (; sp + 16 <= capacity; sp += 16) {
+      __m128i cells = _mm_loadu_si128((const __m128i *)(tape + sp));
+      uint32_t hits = _mm_movemask_epi8(_mm_cmpeq_epi8(cells, zero));
+      if ((hits &= stride_mask[stride]))
+        return sp + __builtin_ctz(hits);
+    }
+  }
+#endif
+  for (; sp < capacity; sp += stride) {
+    if (!tape[sp])
+      return sp;
+  }
+  return -1;
+}
+
+/* finds the first zero cell at sp, sp - stride, ... after the start of the
+ * tape, returning -1 if there is none */
+static ssize_t scan_left8(const uint8_t *tape, ssize_t sp, size_t stride) {
+#ifdef __SSE2__
+  if (stride <= 8 && stride_mask[stride]) {
+    const __m128i zero = _mm_setzero_si128();
+    /* the mask is lined up with the top byte, which is sp */
+    uint32_t mask = stride_mask[stride] << (stride - 1);
+    for (; sp >= 15; sp -= 16) {
+      __m128i cells = _mm_loadu_si128((const __m128i *)(tape + sp - 15));
+      uint32_t hits = _mm_movemask_epi8(_mm_cmpeq_epi8(cells, zero));
+      if ((hits &= mask))
+        return sp - 15 + (31 - __builtin_clz(hits));
+    }
+  }
+#endif
+  for (; sp >= 0; sp -= stride) {
+    if (!tape[sp])
+      return sp;
+  }
+  return -1;
+}
+
+/* the same for wider cells, one cell at a time */
+#define scan_wide(bits)                                                        \
+  static ssize_t scan_right##bits(const uint##bits##_t *tape, size_t sp,       \
+                                  size_t stride, size_t capacity) {            \
+    for (; sp < capacity; sp += stride) {                                      \
+      if (!tape[sp])                                                           \
+        return sp;                                                             \
+    }                                                                          \
+    return -1;                                                                 \
+  }                                                                            \
+  static ssize_t scan_left##bits(const uint##bits##_t *tape, ssize_t sp,       \
+                                 size_t stride) {                              \
+    for (; sp >= 0; sp -= stride) {                                            \
+      if (!tape[sp])                                                           \
+        return sp;                                                             \
     }                                                                          \
-    blk;                                                                       \
-    goto *dispatch_table[opcode(++ip).kind & IR_OP_MAX];                       \
-  }
-
-  goto *dispatch_table[opcode(ip).kind];
-  /* really bad. we need to optimize this */
-  /* dispatch(ir_op_tape, { sp = (sp + opcode(ip).arg) % ctx->capacity; }); */
-  dispatch(ir_op_tape, {
-    sp += opcode(ip).arg;
-    if (sp >= ctx->capacity) {
-      sp -= ctx->capacity;
-    } else if (sp < 0) {
-      sp += ctx->capacity;
+    return -1;                                                                 \
+  }
+
+scan_wide(16)
+scan_wide(32)
+
+/* adds byte i of lanes to cells[i], for i < 8 */
+static inline void add_lanes(uint8_t *cells, uint64_t lanes) {
+#ifdef __SSE2__
+  __m128i sum = _mm_loadl_epi64((const __m128i *)cells);
+  sum = _mm_add_epi8(sum, _mm_set_epi64x(0, lanes));
+  _mm_storel_epi64((__m128i *)cells, sum);
+#else
+  for (int lane = 0; lane < 8; lane++, lanes >>= 8)
+    cells[lane] += lanes;
+#endif
+}
+
+/* sets cells[i] to byte i of lanes, for i < 8 */
+static inline void set_lanes(uint8_t *cells, uint64_t lanes) {
+  for (int lane = 0; lane < 8; lane++, lanes >>= 8)
+    cells[lane] = lanes;
+}
+
+/* the tape mapped over and over, so that going past either end of it lands on
+ * the same cells again without the tape pointer having to wrap. there are
+ * enough copies on both sides for all the moves and offsets between two loop
+ * tests, which bring the pointer back into the middle copy. */
+typedef struct {
+  uint8_t *map;
+  size_t map_length;
+  uint8_t *base;   /* the middle copy */
+  size_t capacity; /* in bytes */
+} tape_ring_t;
+
+/* how far from where the last loop test left the tape pointer the program
+ * gets to, counting cell offsets */
+static size_t ring_reach(ir_ctx *ir_ctx, size_t capacity) {
+  size_t reach = 0;
+  int64_t drift = 0;
+  for (size_t i = 0; i < ir_ctx->length; i++) {
+    ir_op_t op = ir_op_at(ir_ctx, i);
+    int64_t from = drift + op.off, to = from + 1;
+    switch (op.kind) {
+    case IR_OP_TAPE:
+      drift += op.arg;
+      from = to = drift;
+      break;
+    case IR_OP_LOOP_START:
+    case IR_OP_LOOP_END:
+    case IR_OP_SCAN:
+      from = to = drift;
+      drift = 0;
+      break;
+    case IR_OP_VADD:
+    case IR_OP_VSET:
+      to = from + 8;
+      break;
+    case IR_OP_CLEAR:
+      to = from + ((size_t)op.arg < capacity ? op.arg : (int64_t)capacity);
+      break;
+    default:
+      break;
+    }
+    from = from < 0 ? -from : from;
+    to = to < 0 ? -to : to;
+    reach = reach > (size_t)from ? reach : (size_t)from;
+    reach = reach > (size_t)to ? reach : (size_t)to;
+  }
+  return reach;
+}
+
+/* maps a tape of length bytes for the program, which has to be a whole number
+ * of pages, with a guard page at either end */
+static int ring_map(tape_ring_t *ring, size_t length, int cell_size,
+                    ir_ctx *ir_ctx) {
+  size_t page = sysconf(_SC_PAGESIZE);
+  ring->capacity = length;
+  size_t cells = ring->capacity / cell_size;
+  size_t mirrors = ring_reach(ir_ctx, cells) / cells + 1;
+  size_t copies = 2 * mirrors + 1;
+  ring->map_length = copies * ring->capacity + 2 * page;
+
+  int fd = memfd_create("tape", MFD_CLOEXEC);
+  if (fd < 0)
+    return -1;
+  ring->map = MAP_FAILED;
+  if (ftruncate(fd, ring->capacity) == 0)
+    ring->map = mmap(NULL, ring->map_length, PROT_NONE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  for (size_t i = 0; i < copies && ring->map != MAP_FAILED; i++) {
+    void *copy = mmap(ring->map + page + i * ring->capacity, ring->capacity,
+                      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0);
+    if (copy == MAP_FAILED) {
+      munmap(ring->map, ring->map_length);
+      ring->map = MAP_FAILED;
+    }
+  }
+  close(fd);
+  if (ring->map == MAP_FAILED)
+    return -1;
+  ring->base = ring->map + page + mirrors * ring->capacity;
+  return 0;
+}
+
+/* brings the tape pointer back into the middle copy */
+static inline uint8_t *ring_wrap(tape_ring_t *ring, uint8_t *sp) {
+  while (sp >= ring->base + ring->capacity)
+    sp -= ring->capacity;
+  while (sp < ring->base)
+    sp += ring->capacity;
+  return sp;
+}
+
+/* the superinstruction each pair of ops is fused into, 0 for none. these are
+ * the pairs that run back to back the most over the programs in bf_test,
+ * mostly the moves around the multiply loops of mandelbrot.bf. */
+static const uint8_t fused_kind[IR_OP_MAX + 1][IR_OP_MAX + 1] = {
+    [IR_OP_TAPE][IR_OP_LOOP_END] = IR_OP_TAPE_LOOP_END,
+    [IR_OP_TAPE][IR_OP_MUL] = IR_OP_TAPE_MUL,
+    [IR_OP_MUL][IR_OP_SET] = IR_OP_MUL_SET,
+    [IR_OP_SET][IR_OP_TAPE] = IR_OP_SET_TAPE,
+    [IR_OP_CELL][IR_OP_TAPE] = IR_OP_CELL_TAPE,
+    [IR_OP_LOOP_START][IR_OP_TAPE] = IR_OP_LOOP_START_TAPE,
+};
+
+/* fuses pairs of ops into superinstructions, from left to right. only the kind
+ * of the first op changes, the second stays where it is for the loops jumping
+ * to it, so nothing has to be relinked. escaped ops are left alone, so that
+ * the superinstructions can take both ops as packed. */
+static void fuse_ops(ir_ctx *ir_ctx) {
+  for (size_t i = 0; i + 1 < ir_ctx->length; i++) {
+    ir_code_t *code = &ir_ctx->data[i];
+    if ((code[0].kind | code[1].kind) & IR_CODE_ESCAPE)
+      continue;
+    uint8_t kind = fused_kind[code[0].kind][code[1].kind];
+    if (kind) {
+      code[0].kind = kind;
+      i++;
     }
-  });
-  dispatch(ir_op_cell, { ctx->data[sp] += opcode(ip).arg; });
-  /* branchless loads perform much worse */
-  dispatch(ir_op_loop_start, {
-    int64_t delta = opcode(ip).arg;
-    /* ip += (ctx->data[sp] == 0) * delta; */
-    if (!ctx->data[sp]) {
-      ip += delta;
+  }
+}
+
+/* an op threaded for one engine: its handler as an offset from the engine's
+ * first label, then the packed op, or for the ops that jump, the op they jump
+ * to. the handlers are looked up by the kind with the escape bit, escaped ops
+ * having handlers of their own that go to the side table, so the rest unpack
+ * theirs without a test. loops never need that. the pointer makes it 16 bytes,
+ * which runs faster than 8 with an index the loops add to the code. */
+typedef struct thread_op_t {
+  int32_t handler;
+  union {
+    ir_code_t code;
+    const struct thread_op_t *target;
+  };
+} thread_op_t;
+
+static thread_op_t *thread_ops(ir_ctx *ir_ctx, const int32_t *handlers) {
+  thread_op_t *code = malloc(ir_ctx->length * sizeof(*code));
+  for (size_t i = 0; code && i < ir_ctx->length; i++) {
+    ir_code_t op = ir_ctx->data[i];
+    switch (op.kind & IR_OP_MAX) {
+    case IR_OP_LOOP_START:
+    case IR_OP_LOOP_END:
+    case IR_OP_LOOP_START_TAPE:
+      code[i].handler = handlers[op.kind & IR_OP_MAX];
+      code[i].target = code + i + ir_code_unpack(op, ir_ctx->wide.data).arg;
+      break;
+    default:
+      code[i].handler = handlers[op.kind];
+      code[i].code = op;
+      break;
     }
-  });
-  dispatch(ir_op_loop_end, {
-    int64_t delta = opcode(ip).arg;
-    /* ip += (ctx->data[sp] != 0) * delta; */
-    if (ctx->data[sp]) {
-      ip += delta;
+  }
+  return code;
+}
+
+#define IO_BUFFER_LENGTH 0x10000
+
+/* stdio without the locking, going straight to the file descriptors */
+typedef struct {
+  size_t pos, length;
+  uint8_t data[IO_BUFFER_LENGTH];
+} io_buffer_t;
+
+static void io_flush(io_buffer_t *out) {
+  for (size_t done = 0; done < out->length;) {
+    ssize_t written =
+        write(STDOUT_FILENO, out->data + done, out->length - done);
+    if (written < 0 && errno == EINTR)
+      continue;
+    if (written <= 0)
+      break;
+    done += written;
+  }
+  out->length = 0;
+}
+
+/* writes c count times */
+static inline void io_put(io_buffer_t *out, uint8_t c, size_t count) {
+  while (count) {
+    if (out->length == sizeof(out->data))
+      io_flush(out);
+    size_t n = sizeof(out->data) - out->length;
+    n = n < count ? n : count;
+    memset(out->data + out->length, c, n);
+    out->length += n;
+    count -= n;
+  }
+}
+
+/* returns the next byte of input, or -1 at the end of it. the output is
+ * flushed before waiting on more input, so prompts still show up. */
+static inline int io_get(io_buffer_t *in, io_buffer_t *out) {
+  if (in->pos == in->length) {
+    ssize_t got = 0;
+    io_flush(out);
+    do {
+      got = read(STDIN_FILENO, in->data, sizeof(in->data));
+    } while (got < 0 && errno == EINTR);
+    if (got <= 0)
+      return -1;
+    in->pos = 0;
+    in->length = got;
+  }
+  return in->data[in->pos++];
+}
+
+/* the ops that also make up the superinstructions, for the engines to run
+ * with their own opcode and cell. a loop goes on after the op target takes it
+ * to. */
+#define exec_tape(i) (sp = move(opcode(i).arg))
+#define exec_cell(i) (cell(opcode(i).off) += opcode(i).arg)
+#define exec_set(i) (cell(opcode(i).off) = opcode(i).arg)
+#define exec_mul(i) (cell(opcode(i).off) += opcode(i).arg * *sp)
+
+/* only 8 bit cells get vector ops. lanes running off the end of a tape that
+ * wraps cell by cell go one at a time. */
+#define exec_lanes(i, lanes_fn, lane_op)                                       \
+  do {                                                                         \
+    uint64_t lanes = opcode(i).arg;                                            \
+    if (wraps(opcode(i).off, 8)) {                                             \
+      for (int lane = 0; lane < 8; lane++, lanes >>= 8)                        \
+        cell(opcode(i).off + lane) lane_op (uint8_t)lanes;                     \
+    } else {                                                                   \
+      lanes_fn((uint8_t *)&cell(opcode(i).off), lanes);                        \
+    }                                                                          \
+  } while (0)
+#define exec_vadd(i) exec_lanes(i, add_lanes, +=)
+#define exec_vset(i) exec_lanes(i, set_lanes, =)
+#define exec_clear(i, cells)                                                   \
+  do {                                                                         \
+    size_t count = opcode(i).arg;                                              \
+    if (count > (cells))                                                       \
+      count = (cells);                                                         \
+    if (wraps(opcode(i).off, count)) {                                         \
+      for (size_t j = 0; j < count; j++)                                       \
+        cell(opcode(i).off + (int64_t)j) = 0;                                  \
+    } else {                                                                   \
+      memset(&cell(opcode(i).off), 0, count * sizeof(*sp));                    \
+    }                                                                          \
+  } while (0)
+
+/* the dispatch loop for each cell width, once for programs that stay on the
+ * tape, once for programs that need the ring and once more for when the tape
+ * is too odd a size to be mapped as one */
+#define interpret_engines(bits)                                                \
+  interpret_in_range##bits, interpret_ring##bits, interpret_wrapped##bits
+#define INTERPRET_BITS 8
+#define INTERPRET_ENGINE interpret_in_range8
+#define INTERPRET_WRAP 0
+#include "ir_interpret_engine.h"
+#define INTERPRET_BITS 8
+#define INTERPRET_ENGINE interpret_ring8
+#define INTERPRET_WRAP 1
+#include "ir_interpret_engine.h"
+#define INTERPRET_BITS 8
+#define INTERPRET_ENGINE interpret_wrapped8
+#define INTERPRET_WRAP 2
+#include "ir_interpret_engine.h"
+#define INTERPRET_BITS 16
+#define INTERPRET_ENGINE interpret_in_range16
+#define INTERPRET_WRAP 0
+#include "ir_interpret_engine.h"
+#define INTERPRET_BITS 16
+#define INTERPRET_ENGINE interpret_ring16
+#define INTERPRET_WRAP 1
+#include "ir_interpret_engine.h"
+#define INTERPRET_BITS 16
+#define INTERPRET_ENGINE interpret_wrapped16
+#define INTERPRET_WRAP 2
+#include "ir_interpret_engine.h"
+#define INTERPRET_BITS 32
+#define INTERPRET_ENGINE interpret_in_range32
+#define INTERPRET_WRAP 0
+#include "ir_interpret_engine.h"
+#define INTERPRET_BITS 32
+#define INTERPRET_ENGINE interpret_ring32
+#define INTERPRET_WRAP 1
+#include "ir_interpret_engine.h"
+#define INTERPRET_BITS 32
+#define INTERPRET_ENGINE interpret_wrapped32
+#define INTERPRET_WRAP 2
+#include "ir_interpret_engine.h"
+
+/* the tail-call engines. each op is a function that hands the next op over
+ * with a tail call, or returns it to a loop that calls it, leaving sp in the
+ * call_tape_t. */
+typedef struct call_tape_t call_tape_t;
+typedef struct call_op_t call_op_t;
+
+typedef const call_op_t *(*call_fn_t)(const call_op_t *ip, void *sp,
+                                      call_tape_t *tape);
+
+/* an op threaded for the tail-call engines, like a thread_op_t, with the op a
+ * loop jumps to as a pointer */
+struct call_op_t {
+  call_fn_t fn;
+  union {
+    ir_code_t code;
+    const call_op_t *target;
+  };
+};
+
+struct call_tape_t {
+  const ir_op_t *wide; /* the side table of the program */
+  tape_ring_t *ring;
+  interpret_ctx_t *ctx;
+  io_buffer_t *in, *out;
+  void *sp;
+};
+
+/* CALL_TAIL picks how call_next gets to the next op: 0 returns it to the
+ * loop, 1 is a tail call promised by musttail, and 2 is a plain call in tail
+ * position, which the optimiser turns into a jump at -O2 and up but does not
+ * have to. it is 1 where the compiler has musttail and 0 elsewhere, unless
+ * the build sets it. */
+#if defined(__has_attribute)
+#if __has_attribute(musttail)
+#define CALL_MUSTTAIL
+#endif
+#endif
+
+#ifndef CALL_TAIL
+#ifdef CALL_MUSTTAIL
+#define CALL_TAIL 1
+#else
+#define CALL_TAIL 0
+#endif
+#endif
+
+#if CALL_TAIL == 1
+#ifndef CALL_MUSTTAIL
+#error "CALL_TAIL=1 needs the musttail attribute, from clang 13 or GCC 15"
+#endif
+#define call_next(next, sp)                                                    \
+  __attribute__((musttail)) return (next)->fn(next, sp, tape)
+#elif CALL_TAIL == 2
+#define call_next(next, sp) return (next)->fn(next, sp, tape)
+#else
+#define call_next(next, sp)                                                    \
+  do {                                                                         \
+    tape->sp = sp;                                                             \
+    return next;                                                               \
+  } while (0)
+#endif
+
+static call_op_t *call_ops(ir_ctx *ir_ctx, const call_fn_t *handlers) {
+  call_op_t *code = malloc(ir_ctx->length * sizeof(*code));
+  for (size_t i = 0; code && i < ir_ctx->length; i++) {
+    ir_code_t op = ir_ctx->data[i];
+    switch (op.kind & IR_OP_MAX) {
+    case IR_OP_LOOP_START:
+    case IR_OP_LOOP_END:
+    case IR_OP_LOOP_START_TAPE:
+      code[i].fn = handlers[op.kind & IR_OP_MAX];
+      code[i].target = code + i + ir_code_unpack(op, ir_ctx->wide.data).arg;
+      break;
+    default:
+      code[i].fn = handlers[op.kind];
+      code[i].code = op;
+      break;
     }
-  });
-  dispatch(ir_op_write, {
-    for (int64_t i = 0; i < opcode(ip).arg; i++) {
-      fwrite(ctx->data + sp, sizeof(char), 1, stdout);
+  }
+  return code;
+}
+
+#define call_engines(bits)                                                     \
+  call_in_range##bits, call_ring##bits, call_wrapped##bits
+#define INTERPRET_BITS 8
+#define INTERPRET_ENGINE call_in_range8
+#define INTERPRET_WRAP 0
+#include "ir_interpret_calls.h"
+#define INTERPRET_BITS 8
+#define INTERPRET_ENGINE call_ring8
+#define INTERPRET_WRAP 1
+#include "ir_interpret_calls.h"
+#define INTERPRET_BITS 8
+#define INTERPRET_ENGINE call_wrapped8
+#define INTERPRET_WRAP 2
+#include "ir_interpret_calls.h"
+#define INTERPRET_BITS 16
+#define INTERPRET_ENGINE call_in_range16
+#define INTERPRET_WRAP 0
+#include "ir_interpret_calls.h"
+#define INTERPRET_BITS 16
+#define INTERPRET_ENGINE call_ring16
+#define INTERPRET_WRAP 1
+#include "ir_interpret_calls.h"
+#define INTERPRET_BITS 16
+#define INTERPRET_ENGINE call_wrapped16
+#define INTERPRET_WRAP 2
+#include "ir_interpret_calls.h"
+#define INTERPRET_BITS 32
+#define INTERPRET_ENGINE call_in_range32
+#define INTERPRET_WRAP 0
+#include "ir_interpret_calls.h"
+#define INTERPRET_BITS 32
+#define INTERPRET_ENGINE call_ring32
+#define INTERPRET_WRAP 1
+#include "ir_interpret_calls.h"
+#define INTERPRET_BITS 32
+#define INTERPRET_ENGINE call_wrapped32
+#define INTERPRET_WRAP 2
+#include "ir_interpret_calls.h"
+
+typedef size_t (*interpret_engine_t)(ir_ctx *, interpret_ctx_t *,
+                                     tape_ring_t *);
+
+/* by whether to use tail calls, the size of a cell in bytes, then how the tape
+ * wraps */
+static const interpret_engine_t engines[][5][3] = {
+    [0][1] = {interpret_engines(8)},
+    [0][2] = {interpret_engines(16)},
+    [0][4] = {interpret_engines(32)},
+    [1][1] = {call_engines(8)},
+    [1][2] = {call_engines(16)},
+    [1][4] = {call_engines(32)},
+};
+
+/* runs the program on the tape, which ends up with what the program left on
+ * it. programs that can be shown to stay on the tape run on it directly, the
+ * rest run on a ring of as many cells. that is mapped when the tape is a whole
+ * number of pages, otherwise every cell wraps on its own. */
+size_t ir_interpret(ir_ctx *ir_ctx, interpret_ctx_t *ctx) {
+  ir_tape_range_t range = ir_ctx_tape_range(ir_ctx);
+  size_t cells = ctx->capacity / ctx->cell_size;
+  /* patch code to have a halt instruction */
+  ir_op_push(ir_ctx, (ir_op_t){.kind = IR_OP_MAX, .arg = 0});
+  if (range.known && range.min >= 0 && (size_t)range.max < cells) {
+    tape_ring_t tape = {.base = ctx->data, .capacity = ctx->capacity};
+    fuse_ops(ir_ctx);
+    return engines[ctx->tail_calls][ctx->cell_size][0](ir_ctx, ctx, &tape);
+  }
+  if (ctx->capacity % sysconf(_SC_PAGESIZE)) {
+    tape_ring_t tape = {.base = ctx->data, .capacity = ctx->capacity};
+    fuse_ops(ir_ctx);
+    return engines[ctx->tail_calls][ctx->cell_size][2](ir_ctx, ctx, &tape);
+  }
+
+  tape_ring_t ring;
+  if (ring_map(&ring, ctx->capacity, ctx->cell_size, ir_ctx)) {
+    perror("unable to map the tape");
+    return 1;
+  }
+  /* the ring is sized by the plain ops */
+  fuse_ops(ir_ctx);
+  memcpy(ring.base, ctx->data, ctx->capacity);
+  size_t ret = engines[ctx->tail_calls][ctx->cell_size][1](ir_ctx, ctx, &ring);
+  memcpy(ctx->data, ring.base, ctx->capacity);
+  munmap(ring.map, ring.map_length);
+  return ret;
+}
+
+/* runs the program until it wants input or has used up its fuel, keeping
+ * whatever it writes. every trip round a loop costs one unit of fuel. the tape
+ * has to be set up like for ir_interpret, with 8 bit cells, but does not wrap:
+ * an op that would leave it is left to the compiled program, to fault on.
+ * returns the index of the first op that did not run. */
+size_t ir_partial_eval(ir_ctx *ir_ctx, partial_eval_t *pe, uint64_t fuel) {
+  interpret_ctx_t *ctx = &pe->tape;
+#define on_tape(from, n)                                                       \
+  ((size_t)(sp + (from)) < ctx->capacity &&                                    \
+   (size_t)(sp + (from) + (n)-1) < ctx->capacity)
+#define cell(off) ctx->data[sp + (off)]
+  size_t ip = 0;
+  size_t sp = 0;
+  for (; ip < ir_ctx->length; ip++) {
+    ir_op_t op = ir_op_at(ir_ctx, ip);
+    switch (op.kind) {
+    case IR_OP_TAPE:
+      if (!on_tape(op.arg, 1))
+        goto done;
+      sp += op.arg;
+      break;
+    case IR_OP_CELL:
+      if (!on_tape(op.off, 1))
+        goto done;
+      cell(op.off) += op.arg;
+      break;
+    case IR_OP_LOOP_START:
+      if (!ctx->data[sp])
+        ip += op.arg;
+      break;
+    case IR_OP_LOOP_END:
+      if (ctx->data[sp]) {
+        if (!fuel--)
+          goto done;
+        ip += op.arg;
+      }
+      break;
+    case IR_OP_LOOP_ENTER:
+      break;
+    case IR_OP_WRITE:
+      if (!on_tape(op.off, 1))
+        goto done;
+      for (int64_t i = 0; i < op.arg; i++)
+        vec_push(&pe->output, cell(op.off));
+      break;
+    case IR_OP_SET:
+      if (!on_tape(op.off, 1))
+        goto done;
+      cell(op.off) = op.arg;
+      break;
+    case IR_OP_MUL:
+      if (!on_tape(op.off, 1))
+        goto done;
+      cell(op.off) += op.arg * ctx->data[sp];
+      break;
+    case IR_OP_SCAN: {
+      /* each step is a trip round the loop the scan came from. running off
+       * the tape before finding a zero is left to the program. */
+      size_t at = sp;
+      while (ctx->data[at]) {
+        if ((size_t)(at + op.arg) >= ctx->capacity || !fuel--)
+          goto done;
+        at += op.arg;
+      }
+      sp = at;
+      break;
     }
-  });
-  dispatch(ir_op_read, {
-    for (int64_t i = 0; i < opcode(ip).arg; i++) {
-      fread(ctx->data + sp, sizeof(char), 1, stdin);
+    case IR_OP_VADD:
+      if (!on_tape(op.off, 8))
+        goto done;
+      for (int lane = 0; lane < 8; lane++)
+        cell(op.off + lane) += (uint64_t)op.arg >> (8 * lane);
+      break;
+    case IR_OP_VSET:
+      if (!on_tape(op.off, 8))
+        goto done;
+      for (int lane = 0; lane < 8; lane++)
+        cell(op.off + lane) = (uint64_t)op.arg >> (8 * lane);
+      break;
+    case IR_OP_CLEAR:
+      if (!on_tape(op.off, op.arg))
+        goto done;
+      memset(&cell(op.off), 0, op.arg);
+      break;
+    default:
+      /* reads and the halt op */
+      goto done;
     }
-  });
-  dispatch(ir_op_set, { ctx->data[sp] = opcode(ip).arg; });
-  dispatch(ir_op_halt, {
-    fflush(stdout);
-    return 0;
-  });
+  }
+done:
+  pe->sp = sp;
+  pe->ip = ip;
+  return ip;
 }
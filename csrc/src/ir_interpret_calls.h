@@ -0,0 +1,209 @@
+/* a tail-call engine for ir_interpret.c, which includes it once per engine
+ * with INTERPRET_ENGINE naming the function, INTERPRET_BITS the width of a
+ * cell and INTERPRET_WRAP set when the tape pointer can leave the tape, as for
+ * ir_interpret_engine.h. every op is a small function of its own, which goes
+ * on to the next one with call_next. */
+
+#define engine_paste_(a, b) a##b
+#define engine_paste(a, b) engine_paste_(a, b)
+#define engine_cell_t engine_paste(engine_paste(uint, INTERPRET_BITS), _t)
+#define engine_scan_right engine_paste(scan_right, INTERPRET_BITS)
+#define engine_scan_left engine_paste(scan_left, INTERPRET_BITS)
+#define call_name(name) engine_paste(INTERPRET_ENGINE, _##name)
+
+#define opcode(ir_op_ip)                                                       \
+  (escaped ? ir_code_escaped((ir_op_ip)->code, tape->wide)                     \
+           : ir_code_packed((ir_op_ip)->code))
+#define target(ir_op_ip) ((ir_op_ip)->target)
+#define tape_base() ((engine_cell_t *)tape->ring->base)
+#define tape_cells() (tape->ring->capacity / sizeof(*sp))
+#if INTERPRET_WRAP == 2
+#define cell(off) tape_base()[tape_wrap(sp - tape_base() + (off), tape_cells())]
+#define move(n) (tape_base() + tape_wrap(sp - tape_base() + (n), tape_cells()))
+#define wraps(off, n) ((size_t)(sp - tape_base() + (off)) + (n) > tape_cells())
+#define ring_sp() (sp)
+#else
+#define cell(off) sp[off]
+#define move(n) (sp + (n))
+#define wraps(off, n) 0
+#define ring_sp()                                                              \
+  ((engine_cell_t *)ring_wrap(tape->ring, (uint8_t *)sp))
+#endif
+#define call_op_as(name, escaped_, blk)                                        \
+  static const call_op_t *call_name(name)(const call_op_t *ip, void *sp_,      \
+                                          call_tape_t *tape) {                 \
+    enum { escaped = escaped_ };                                               \
+    engine_cell_t *sp = sp_;                                                   \
+    blk;                                                                       \
+    call_next(ip + 1, sp);                                                     \
+  }
+/* with another function for when the op is escaped */
+#define call_op(name, blk)                                                     \
+  call_op_as(name, 0, blk) call_op_as(name##_escaped, 1, blk)
+
+call_op(tape, { exec_tape(ip); });
+call_op(cell, { exec_cell(ip); });
+call_op_as(loop_start, 0, {
+  if (!*sp) {
+    ip = target(ip);
+  }
+  if (INTERPRET_WRAP)
+    sp = ring_sp();
+});
+/* the cell is known to be nonzero, so there is nothing to test */
+call_op(loop_enter, {});
+call_op_as(loop_end, 0, {
+  if (*sp) {
+    ip = target(ip);
+  }
+  if (INTERPRET_WRAP)
+    sp = ring_sp();
+});
+call_op(write,
+        { io_put(tape->out, cell(opcode(ip).off), opcode(ip).arg); });
+call_op(read, {
+  for (int64_t i = 0; i < opcode(ip).arg; i++) {
+    int c = io_get(tape->in, tape->out);
+    if (c >= 0)
+      cell(opcode(ip).off) = c;
+    else if (tape->ctx->eof != EOF_UNCHANGED)
+      cell(opcode(ip).off) = tape->ctx->eof;
+  }
+});
+call_op(set, { exec_set(ip); });
+call_op(mul, { exec_mul(ip); });
+call_op(scan, {
+  engine_cell_t *base = tape_base();
+  size_t cells = tape_cells();
+  int64_t stride = opcode(ip).arg;
+  size_t at = ring_sp() - base;
+  ssize_t found = -1;
+  /* search up to the end of the tape, then carry on from where the moves
+   * would have wrapped around to */
+  while (found < 0) {
+    if (stride > 0) {
+      found = engine_scan_right(base, at, stride, cells);
+      at += ((cells - 1 - at) / stride + 1) * stride;
+    } else {
+      found = engine_scan_left(base, at, -stride);
+      at -= (at / -stride + 1) * -stride;
+    }
+    at = tape_wrap(at, cells);
+  }
+  sp = base + found;
+});
+call_op(vadd, { exec_vadd(ip); });
+call_op(vset, { exec_vset(ip); });
+call_op(clear, { exec_clear(ip, tape_cells()); });
+/* the superinstructions, as in the computed goto engines */
+call_op_as(tape_loop_end, 0, {
+  exec_tape(ip);
+  ip++;
+  if (*sp) {
+    ip = target(ip);
+  }
+  if (INTERPRET_WRAP)
+    sp = ring_sp();
+});
+call_op_as(tape_mul, 0, {
+  exec_tape(ip);
+  ip++;
+  exec_mul(ip);
+});
+call_op_as(mul_set, 0, {
+  exec_mul(ip);
+  ip++;
+  exec_set(ip);
+});
+call_op_as(set_tape, 0, {
+  exec_set(ip);
+  ip++;
+  exec_tape(ip);
+});
+call_op_as(cell_tape, 0, {
+  exec_cell(ip);
+  ip++;
+  exec_tape(ip);
+});
+call_op_as(loop_start_tape, 0, {
+  if (INTERPRET_WRAP)
+    sp = ring_sp();
+  if (!*sp) {
+    ip = target(ip);
+  } else {
+    ip++;
+    exec_tape(ip);
+  }
+});
+call_op_as(halt, 0, {
+  unused(sp);
+  io_flush(tape->out);
+  return NULL;
+});
+
+static size_t INTERPRET_ENGINE(ir_ctx *ir_ctx, interpret_ctx_t *ctx,
+                               tape_ring_t *ring) {
+#define handler(kind, name)                                                    \
+  [kind] = call_name(name), [kind | IR_CODE_ESCAPE] = call_name(name##_escaped)
+  static const call_fn_t handlers[] = {
+      handler(IR_OP_TAPE, tape),
+      handler(IR_OP_CELL, cell),
+      [IR_OP_LOOP_START] = call_name(loop_start),
+      [IR_OP_LOOP_END] = call_name(loop_end),
+      handler(IR_OP_WRITE, write),
+      handler(IR_OP_READ, read),
+      handler(IR_OP_SET, set),
+      handler(IR_OP_MUL, mul),
+      handler(IR_OP_SCAN, scan),
+      handler(IR_OP_LOOP_ENTER, loop_enter),
+      handler(IR_OP_VADD, vadd),
+      handler(IR_OP_VSET, vset),
+      handler(IR_OP_CLEAR, clear),
+      [IR_OP_TAPE_LOOP_END] = call_name(tape_loop_end),
+      [IR_OP_TAPE_MUL] = call_name(tape_mul),
+      [IR_OP_MUL_SET] = call_name(mul_set),
+      [IR_OP_SET_TAPE] = call_name(set_tape),
+      [IR_OP_CELL_TAPE] = call_name(cell_tape),
+      [IR_OP_LOOP_START_TAPE] = call_name(loop_start_tape),
+      [IR_OP_MAX] = call_name(halt),
+  };
+#undef handler
+  /* too big for the stack */
+  static io_buffer_t in, out;
+  call_op_t *code = call_ops(ir_ctx, handlers);
+  if (!code) {
+    perror("unable to decode the program");
+    return 1;
+  }
+  call_tape_t tape = {.wide = ir_ctx->wide.data,
+                      .ring = ring,
+                      .ctx = ctx,
+                      .in = &in,
+                      .out = &out,
+                      .sp = ring->base};
+  /* with tail calls the first call only comes back from the halt op */
+  for (const call_op_t *ip = code; ip;)
+    ip = ip->fn(ip, tape.sp, &tape);
+  free(code);
+  return 0;
+}
+
+#undef opcode
+#undef target
+#undef tape_base
+#undef tape_cells
+#undef cell
+#undef move
+#undef wraps
+#undef ring_sp
+#undef call_op_as
+#undef call_op
+#undef call_name
+#undef engine_paste_
+#undef engine_paste
+#undef engine_cell_t
+#undef engine_scan_right
+#undef engine_scan_left
+#undef INTERPRET_ENGINE
+#undef INTERPRET_BITS
+#undef INTERPRET_WRAP
@@ -0,0 +1,207 @@
+/* a dispatch loop for ir_interpret.c, which includes it once per engine with
+ * INTERPRET_ENGINE naming the function, INTERPRET_BITS the width of a cell
+ * and INTERPRET_WRAP set when the tape pointer can leave the tape: 1 when the
+ * tape is then mapped as a ring, 2 when every cell wraps on its own */
+
+#define engine_paste_(a, b) a##b
+#define engine_paste(a, b) engine_paste_(a, b)
+#define engine_cell_t engine_paste(engine_paste(uint, INTERPRET_BITS), _t)
+#define engine_scan_right engine_paste(scan_right, INTERPRET_BITS)
+#define engine_scan_left engine_paste(scan_left, INTERPRET_BITS)
+
+static size_t INTERPRET_ENGINE(ir_ctx *ir_ctx, interpret_ctx_t *ctx,
+                               tape_ring_t *ring) {
+  /* the handlers as offsets from the first one, which keeps the threaded ops
+   * at 8 bytes. each op but the loops and the superinstructions has a handler
+   * for when it is escaped as well. */
+#define handler(kind, label)                                                   \
+  [kind] = &&label - &&ir_op_tape,                                             \
+  [kind | IR_CODE_ESCAPE] = &&label##_escaped - &&ir_op_tape
+  static const int32_t dispatch_table[] = {
+      handler(IR_OP_TAPE, ir_op_tape),
+      handler(IR_OP_CELL, ir_op_cell),
+      [IR_OP_LOOP_START] = &&ir_op_loop_start - &&ir_op_tape,
+      [IR_OP_LOOP_END] = &&ir_op_loop_end - &&ir_op_tape,
+      handler(IR_OP_WRITE, ir_op_write),
+      handler(IR_OP_READ, ir_op_read),
+      handler(IR_OP_SET, ir_op_set),
+      handler(IR_OP_MUL, ir_op_mul),
+      handler(IR_OP_SCAN, ir_op_scan),
+      handler(IR_OP_LOOP_ENTER, ir_op_loop_enter),
+      handler(IR_OP_VADD, ir_op_vadd),
+      handler(IR_OP_VSET, ir_op_vset),
+      handler(IR_OP_CLEAR, ir_op_clear),
+      [IR_OP_TAPE_LOOP_END] = &&ir_op_tape_loop_end - &&ir_op_tape,
+      [IR_OP_TAPE_MUL] = &&ir_op_tape_mul - &&ir_op_tape,
+      [IR_OP_MUL_SET] = &&ir_op_mul_set - &&ir_op_tape,
+      [IR_OP_SET_TAPE] = &&ir_op_set_tape - &&ir_op_tape,
+      [IR_OP_CELL_TAPE] = &&ir_op_cell_tape - &&ir_op_tape,
+      [IR_OP_LOOP_START_TAPE] = &&ir_op_loop_start_tape - &&ir_op_tape,
+      [IR_OP_MAX] = &&ir_op_halt - &&ir_op_tape,
+  };
+#undef handler
+  thread_op_t *code = thread_ops(ir_ctx, dispatch_table);
+  if (!code) {
+    perror("unable to decode the program");
+    return 1;
+  }
+  /* walking the ops with a pointer leaves the ring engines one more register,
+   * which keeps ip out of memory */
+  const thread_op_t *ip = code;
+  const ir_op_t *wide = ir_ctx->wide.data;
+  engine_cell_t *sp = (engine_cell_t *)ring->base;
+  engine_cell_t *base = sp;
+  size_t cells = ring->capacity / sizeof(*sp);
+  char buf[1024] = {0};
+  /* too big for the stack */
+  static io_buffer_t in, out;
+#define opcode(ir_op_ip)                                                       \
+  (escaped ? ir_code_escaped((ir_op_ip)->code, wide)                           \
+           : ir_code_packed((ir_op_ip)->code))
+#define target(ir_op_ip) ((ir_op_ip)->target)
+#if INTERPRET_WRAP == 2
+#define cell(off) base[tape_wrap(sp - base + (off), cells)]
+#define move(n) (base + tape_wrap(sp - base + (n), cells))
+#define wraps(off, n) ((size_t)(sp - base + (off)) + (n) > cells)
+#define ring_sp() (sp)
+#else
+#define cell(off) sp[off]
+#define move(n) (sp + (n))
+#define wraps(off, n) 0
+#define ring_sp() ((engine_cell_t *)ring_wrap(ring, (uint8_t *)sp))
+#endif
+#define dispatch_as(label, escaped_, blk)                                      \
+  label : {                                                                    \
+    enum { escaped = escaped_ };                                               \
+    if (0) {                                                                   \
+      printf("[%8td;%8td] %s\n", ip - code, sp - base,                         \
+             ir_fmt_op(opcode(ip), buf));                                      \
+    } else {                                                                   \
+      unused(buf);                                                             \
+    }                                                                          \
+    blk;                                                                       \
+    goto *(&&ir_op_tape + (++ip)->handler);                                    \
+  }
+#define dispatch(label, blk)                                                   \
+  dispatch_as(label, 0, blk);                                                  \
+  dispatch_as(label##_escaped, 1, blk)
+
+  goto *(&&ir_op_tape + ip->handler);
+  /* the ring wraps the moves, the loop tests bring sp back into its middle */
+  dispatch(ir_op_tape, { exec_tape(ip); });
+  dispatch(ir_op_cell, { exec_cell(ip); });
+  /* branchless loads perform much worse */
+  dispatch_as(ir_op_loop_start, 0, {
+    if (!*sp) {
+      ip = target(ip);
+    }
+    if (INTERPRET_WRAP)
+      sp = ring_sp();
+  });
+  /* the cell is known to be nonzero, so there is nothing to test */
+  dispatch(ir_op_loop_enter, {});
+  dispatch_as(ir_op_loop_end, 0, {
+    if (*sp) {
+      ip = target(ip);
+    }
+    if (INTERPRET_WRAP)
+      sp = ring_sp();
+  });
+  dispatch(ir_op_write,
+           { io_put(&out, cell(opcode(ip).off), opcode(ip).arg); });
+  dispatch(ir_op_read, {
+    for (int64_t i = 0; i < opcode(ip).arg; i++) {
+      int c = io_get(&in, &out);
+      if (c >= 0)
+        cell(opcode(ip).off) = c;
+      else if (ctx->eof != EOF_UNCHANGED)
+        cell(opcode(ip).off) = ctx->eof;
+    }
+  });
+  dispatch(ir_op_set, { exec_set(ip); });
+  dispatch(ir_op_mul, { exec_mul(ip); });
+  dispatch(ir_op_scan, {
+    int64_t stride = opcode(ip).arg;
+    size_t at = ring_sp() - base;
+    ssize_t found = -1;
+    /* search up to the end of the tape, then carry on from where the moves
+     * would have wrapped around to */
+    while (found < 0) {
+      if (stride > 0) {
+        found = engine_scan_right(base, at, stride, cells);
+        at += ((cells - 1 - at) / stride + 1) * stride;
+      } else {
+        found = engine_scan_left(base, at, -stride);
+        at -= (at / -stride + 1) * -stride;
+      }
+      at = tape_wrap(at, cells);
+    }
+    sp = base + found;
+  });
+  dispatch(ir_op_vadd, { exec_vadd(ip); });
+  dispatch(ir_op_vset, { exec_vset(ip); });
+  dispatch(ir_op_clear, { exec_clear(ip, cells); });
+  /* the superinstructions run the op at ip and the one after it, which stays in
+   * place for jumps that land right in front of it */
+  dispatch_as(ir_op_tape_loop_end, 0, {
+    exec_tape(ip);
+    ip++;
+    if (*sp) {
+      ip = target(ip);
+    }
+    if (INTERPRET_WRAP)
+      sp = ring_sp();
+  });
+  dispatch_as(ir_op_tape_mul, 0, {
+    exec_tape(ip);
+    ip++;
+    exec_mul(ip);
+  });
+  dispatch_as(ir_op_mul_set, 0, {
+    exec_mul(ip);
+    ip++;
+    exec_set(ip);
+  });
+  dispatch_as(ir_op_set_tape, 0, {
+    exec_set(ip);
+    ip++;
+    exec_tape(ip);
+  });
+  dispatch_as(ir_op_cell_tape, 0, {
+    exec_cell(ip);
+    ip++;
+    exec_tape(ip);
+  });
+  dispatch_as(ir_op_loop_start_tape, 0, {
+    if (INTERPRET_WRAP)
+      sp = ring_sp();
+    if (!*sp) {
+      ip = target(ip);
+    } else {
+      ip++;
+      exec_tape(ip);
+    }
+  });
+  dispatch_as(ir_op_halt, 0, {
+    io_flush(&out);
+    free(code);
+    return 0;
+  });
+}
+
+#undef opcode
+#undef target
+#undef cell
+#undef move
+#undef wraps
+#undef ring_sp
+#undef dispatch_as
+#undef dispatch
+#undef engine_paste_
+#undef engine_paste
+#undef engine_cell_t
+#undef engine_scan_right
+#undef engine_scan_left
+#undef INTERPRET_ENGINE
+#undef INTERPRET_BITS
+#undef INTERPRET_WRAP
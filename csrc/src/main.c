@@ -1,3 +1,4 @@
+#define _GNU_SOURCE /* MAP_32BIT */
 #include "common.h"
 #include "elf_gen.h"
 #include "ir_compile.h"
@@ -6,9 +7,21 @@
 #include "options.h"
 #include <ir_compile.h>
 #include <stdio.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 
-#define BUFLEN 1024
+#define BUFLEN 0x10000
+/* the cells a program gets unless it can be shown to need some other number,
+ * or is given some with --tape-size. it never gets more than TAPE_CELLS_MAX.
+ * whole pages, so that the interpreter runs it on the ring. */
+#define TAPE_CELLS 32768
+#define TAPE_CELLS_MAX 0x10000000
+/* nothing is mapped this far past either end of the tape, so that running off
+ * it faults */
+#define GUARD_LENGTH 0x100000
+#define IO_BUFFER_LENGTH 0x10000
+/* well clear of the code at 0x08048000 */
+#define DATA_VADDR 0x10000000
 
 #if 0
 /* NOTE: we need to emit this as a start up for our elf files */
@@ -66,49 +79,238 @@ void make_exe(FILE *fp) {
   fchmod(fd, statbuf.st_mode | S_IXUSR | S_IXGRP | S_IXOTH);
 }
 
-void write_elf_file(ir_ctx *ir_ctx, FILE *fp) {
-  elf_gen_ctx elf_ctx = elf_gen_ctx_init();
+/* the pages the tape takes up */
+static size_t tape_length(size_t cells, int cell_size) {
+  return align_to(cells * cell_size, 0x1000);
+}
+
+/* the cells of the tape a partial evaluation left behind, up to the last one
+ * that is not zero */
+static size_t pe_tape_used(partial_eval_t *pe) {
+  size_t used = pe->tape.capacity;
+  while (used && !pe->tape.data[used - 1])
+    used--;
+  return used;
+}
+
+/* the cells asked for, otherwise just the ones the program can be shown to
+ * use, the usual amount when that is not known */
+static size_t tape_cells(ir_ctx *ir_ctx, partial_eval_t *pe,
+                         options_t *options) {
+  if (options->tape_size)
+    return options->tape_size;
+  ir_tape_range_t range = ir_ctx_tape_range(ir_ctx);
+  int64_t sp = pe ? pe->sp : 0;
+  if (!range.known || sp + range.min < 0 ||
+      sp + range.max >= TAPE_CELLS_MAX)
+    return TAPE_CELLS;
+  size_t cells = sp + range.max + 1;
+  if (pe && pe_tape_used(pe) > cells)
+    cells = pe_tape_used(pe);
+  return cells;
+}
+
+/* lays out a guard, a tape of the given number of cells, another guard and
+ * then the io buffers, from data on. the tape goes right up against the guard
+ * past it, so that the first cell past it faults. it starts right after the
+ * guard in front when it is a whole number of pages, like the usual tape, so
+ * that cell -1 faults too. otherwise the rest of its first page comes first. */
+static compile_layout_t data_layout(uint32_t data, size_t cells, size_t sp,
+                                    options_t *options) {
+  uint8_t cell_size = options->cell_bits / 8;
+  uint32_t guard = data + GUARD_LENGTH + tape_length(cells, cell_size);
+  uint32_t tape = guard - cells * cell_size;
+  compile_layout_t layout = {
+      .tape = tape,
+      .sp = tape + sp * cell_size,
+      .cell_size = cell_size,
+      .front_guard = data,
+      .guard = guard,
+      .guard_len = GUARD_LENGTH,
+      .out_buf = guard + GUARD_LENGTH,
+      .out_len = IO_BUFFER_LENGTH,
+      .in_len = IO_BUFFER_LENGTH,
+      .eof = options->eof,
+  };
+  layout.in_buf = layout.out_buf + layout.out_len;
+  layout.in_ptr = layout.in_buf + layout.in_len;
+  return layout;
+}
+
+static size_t data_layout_length(compile_layout_t *layout, uint32_t data) {
+  return layout->in_ptr + 2 * sizeof(uint32_t) - data;
+}
+
+/* pe is what running the program at compile time left behind, if anything */
+void write_elf_file(ir_ctx *ir_ctx, partial_eval_t *pe, options_t *options,
+                    FILE *fp) {
+  elf_gen_ctx elf_ctx =
+      options->x86_64 ? elf_gen_ctx_init(ELFCLASS64, EM_X86_64)
+                      : elf_gen_ctx_init(ELFCLASS32, EM_386);
   defer { elf_gen_ctx_free(&elf_ctx); };
 
-  program_t *text = gen_program_header(&elf_ctx, ".text",
-                                       (Elf32_Phdr){.p_type = PT_LOAD,
-                                                    .p_vaddr = 0x08048000,
-                                                    .p_flags = PF_R | PF_X});
+  program_t *text = gen_program_header(
+      &elf_ctx, ".text",
+      (Elf64_Phdr){.p_type = PT_LOAD,
+                   .p_vaddr = options->x86_64 ? 0x400000 : 0x08048000,
+                   .p_flags = PF_R | PF_X});
   gen_section_header(&elf_ctx, ".text",
-                     (Elf32_Shdr){.sh_type = SHT_PROGBITS,
+                     (Elf64_Shdr){.sh_type = SHT_PROGBITS,
                                   .sh_flags = SHF_ALLOC | SHF_EXECINSTR,
                                   .sh_addr = text->header.p_vaddr});
-  elf_ctx.elf_header.e_entry = text->header.p_vaddr;
-
-  /* this is an ugly terrible hack. */
-  /* since we know that .bss comes directly after .text we hardcode loading
-   * SP_REG with the address of .bss. we can't do it before since we don't know
-   * how big .text will be and we don't it where we generate the rest of the
-   * machine code because i would like to think that code is somewhat clean and
-   * i don't want to ruin that. too much. */
-  /* preload SP_REG with the location of .bss that we will patch later */
-  ctx_push_code(text, 0xb8 + SP_REG);
-  vec_push_as_bytes(text, &text->header.p_vaddr);
-  ir_ctx_compile((compile_ctx *)text, ir_ctx);
-
-  program_t *bss = gen_program_header(
-      &elf_ctx, ".bss",
-      (Elf32_Phdr){.p_type = PT_LOAD,
-                   .p_vaddr =
-                       align_to(text->header.p_vaddr + text->length, 0x1000),
-                   .p_flags = PF_R | PF_W});
-  bss->length = 30e3;
-  gen_section_header(&elf_ctx, ".bss",
-                     (Elf32_Shdr){.sh_type = SHT_NOBITS,
+
+  /* the data lives at a fixed address so the code can refer to it before we
+   * know how long the code is going to be */
+  compile_layout_t layout = data_layout(
+      DATA_VADDR, tape_cells(ir_ctx, pe, options), pe ? pe->sp : 0, options);
+  layout.target = options->x86_64 ? TARGET_X86_64 : TARGET_I386;
+
+  /* the output written before the first read goes in front of the code, which
+   * starts off by writing it all out at once */
+  if (pe)
+    vec_extend(text, &pe->output);
+  layout.code = text->header.p_vaddr + text->length;
+  elf_ctx.elf_header.e_entry = layout.code;
+  compile_ctx code = {.layout = &layout};
+  if (pe && pe->output.length)
+    ir_compile_write_data(&code, text->header.p_vaddr, pe->output.length);
+  ir_ctx_compile(&code, ir_ctx);
+  vec_extend(text, &code);
+  vec_deinit(&code);
+
+  /* a tape left behind by the partial evaluation goes in .data instead. the
+   * guard in front of it is left out */
+  const char *data_name = pe ? ".data" : ".bss";
+  uint32_t tape_pages = DATA_VADDR + GUARD_LENGTH;
+  program_t *data = gen_program_header(&elf_ctx, data_name,
+                                       (Elf64_Phdr){.p_type = PT_LOAD,
+                                                    .p_vaddr = tape_pages,
+                                                    .p_flags = PF_R | PF_W});
+  if (pe) {
+    /* only store the tape up to its last nonzero cell */
+    size_t padding = layout.tape - tape_pages;
+    vec_reserve(data, padding);
+    memset(data->data, 0, padding);
+    data->length = padding;
+    vec_pusharr(data, pe->tape.data, pe_tape_used(pe));
+    data->header.p_memsz = layout.guard - tape_pages;
+  } else {
+    data->length = layout.guard - tape_pages;
+  }
+  gen_section_header(&elf_ctx, data_name,
+                     (Elf64_Shdr){.sh_type = pe ? SHT_PROGBITS : SHT_NOBITS,
+                                  .sh_flags = SHF_ALLOC | SHF_WRITE,
+                                  .sh_addr = data->header.p_vaddr});
+  /* the io buffers go in a segment of their own, past the guard */
+  program_t *io = gen_program_header(&elf_ctx, ".io",
+                                     (Elf64_Phdr){.p_type = PT_LOAD,
+                                                  .p_vaddr = layout.out_buf,
+                                                  .p_flags = PF_R | PF_W});
+  io->length = data_layout_length(&layout, layout.out_buf);
+  gen_section_header(&elf_ctx, ".io",
+                     (Elf64_Shdr){.sh_type = SHT_NOBITS,
                                   .sh_flags = SHF_ALLOC | SHF_WRITE,
-                                  .sh_addr = bss->header.p_vaddr});
-  *(int32_t *)(text->data + 1) = bss->header.p_vaddr;
+                                  .sh_addr = io->header.p_vaddr});
   gen_elf_file(fp, &elf_ctx);
   make_exe(fp);
 }
 
+/* parses the whole file, in place when it can be mapped and a chunk at a time
+ * when it cannot, like a pipe */
+static int parse_file(ir_ctx *ir_ctx, FILE *in_file) {
+  struct stat st = {0};
+  int fd = fileno(in_file);
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+    char *src = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (src != MAP_FAILED) {
+      madvise(src, st.st_size, MADV_SEQUENTIAL);
+      size_t err = ir_ctx_parse(ir_ctx, src, st.st_size);
+      munmap(src, st.st_size);
+      return err;
+    }
+  }
+
+  char defer_var(auto_free) *buffer = malloc(BUFLEN);
+  size_t read_bytes = 0;
+  while ((read_bytes = fread(buffer, sizeof(char), BUFLEN, in_file)) > 0) {
+    if (ir_ctx_parse(ir_ctx, buffer, read_bytes))
+      return 1;
+  }
+  return 0;
+}
+
+/* runs the program for as long as it can without input, then only compiles
+ * what is left of it */
+void write_partial_elf_file(ir_ctx *code, options_t *options, FILE *fp) {
+  partial_eval_t pe = {.tape.cell_size = 1};
+  vec_reserve(&pe.tape, options->tape_size ? options->tape_size : TAPE_CELLS);
+  memset(pe.tape.data, 0, pe.tape.capacity);
+  ir_ctx defer_var(ir_ctx_free) residual = {0};
+  defer {
+    vec_deinit(&pe.tape);
+    vec_deinit(&pe.output);
+  };
+
+  ir_partial_eval(code, &pe, options->partial_eval);
+  ir_ctx_resume(code, pe.ip, &residual);
+  write_elf_file(&residual, &pe, options, fp);
+}
+
+/* compiles the program for the host and runs it in process. the code never
+ * sits in a mapping that is writable and executable at once. */
+int run_jit(ir_ctx *ir_ctx, options_t *options) {
+#ifdef __x86_64__
+  /* the code works with 32 bit addresses, so keep everything in the low 4G */
+  int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_32BIT;
+  size_t cells = options->tape_size ? options->tape_size : TAPE_CELLS;
+  compile_layout_t layout = data_layout(0, cells, 0, options);
+  size_t data_length = data_layout_length(&layout, 0);
+  uint8_t *data = mmap(NULL, data_length, PROT_READ | PROT_WRITE, flags, -1, 0);
+  if (data == MAP_FAILED) {
+    perror("mmap");
+    return 1;
+  }
+  layout = data_layout((uintptr_t)data, cells, 0, options);
+  layout.target = TARGET_X86_64 | TARGET_JIT;
+  mprotect(data, GUARD_LENGTH, PROT_NONE);
+  mprotect((uint8_t *)(uintptr_t)layout.guard, GUARD_LENGTH, PROT_NONE);
+
+  /* the code refers to itself by address, but its length does not depend on
+   * where it goes. so compile once to size the mapping, then again for real */
+  compile_ctx code = {.layout = &layout};
+  defer { vec_deinit(&code); };
+  if (!ir_ctx_compile(&code, ir_ctx)) {
+    munmap(data, data_length);
+    return 1;
+  }
+  size_t code_length = code.length;
+  uint8_t *text = mmap(NULL, code_length, PROT_READ | PROT_WRITE, flags, -1, 0);
+  if (text == MAP_FAILED) {
+    perror("mmap");
+    munmap(data, data_length);
+    return 1;
+  }
+  layout.code = (uintptr_t)text;
+  code.length = 0;
+  ir_ctx_compile(&code, ir_ctx);
+  memcpy(text, code.data, code.length);
+  mprotect(text, code_length, PROT_READ | PROT_EXEC);
+
+  ((void (*)(void))text)();
+
+  munmap(text, code_length);
+  munmap(data, data_length);
+  return 0;
+#else
+  unused(ir_ctx);
+  unused(options);
+  fprintf(stderr, "--jit needs an x86-64 host\n");
+  return 1;
+#endif
+}
+
 int main(int argc, char *argv[]) {
-  options_t options = {NULL, NULL, 0};
+  options_t options = {NULL, NULL, 0, 0, EOF_UNCHANGED, 0, 0, 8, 0, 0};
   if (parse_options(&options, argc, argv)) {
     exit(EXIT_FAILURE);
   }
@@ -121,9 +323,17 @@ int main(int argc, char *argv[]) {
       free(options.input_name);
   };
 
-  char defer_var(auto_free) *buffer = calloc(1, BUFLEN + 1);
+  if (options.tape_size > TAPE_CELLS_MAX) {
+    fprintf(stderr, "the tape is limited to %d cells\n", TAPE_CELLS_MAX);
+    return 1;
+  }
+  /* the partial evaluation only knows about 8 bit cells */
+  if (options.partial_eval && options.cell_bits != 8) {
+    fprintf(stderr, "--partial-eval needs 8 bit cells\n");
+    return 1;
+  }
+
   ir_ctx defer_var(ir_ctx_free) ir_ctx = {0};
-  vec_reserve(&ir_ctx, BUFLEN);
 
   FILE defer_var(auto_fclose) *in_file = fopen(options.input_name, "r");
   if (!in_file) {
@@ -131,35 +341,46 @@ int main(int argc, char *argv[]) {
     return 1;
   }
 
-  size_t read_bytes = 0;
-  do {
-    read_bytes = fread(buffer, sizeof(char), BUFLEN, in_file);
-    buffer[read_bytes] = '\0';
-    if (ir_ctx_parse(&ir_ctx, buffer)) {
-      return 1;
-    }
-  } while (read_bytes > 0);
+  if (parse_file(&ir_ctx, in_file))
+    return 1;
+  /* the [ still open hold how far back the ones around them are, not jumps */
+  if (ir_ctx.open) {
+    fputs("unmatched '['\n", stderr);
+    return 1;
+  }
+
+  ir_ctx_optimize(&ir_ctx, options.cell_bits,
+                  options.tape_size ? options.tape_size : TAPE_CELLS);
 
   if (options.dump_ir) {
     ir_ctx_dump_ir(&ir_ctx);
     return 0;
   }
 
-  if (!options.output_name) {
-    interpret_ctx_t interpret_ctx = {0};
-    vec_reserve(&interpret_ctx, 30e3);
+  if (!options.output_name && options.jit) {
+    return run_jit(&ir_ctx, &options);
+  } else if (!options.output_name) {
+    size_t cells = options.tape_size ? options.tape_size : TAPE_CELLS;
+    interpret_ctx_t interpret_ctx = {.cell_size = options.cell_bits / 8,
+                                     .eof = options.eof,
+                                     .tail_calls = options.tail_calls};
+    vec_reserve(&interpret_ctx, cells * interpret_ctx.cell_size);
     memset(interpret_ctx.data, 0, interpret_ctx.capacity);
     defer { vec_deinit(&interpret_ctx); };
     /* ir_ctx_dump_bf(ir_ctx); */
     /* ir_ctx_dump_ir(ir_ctx); */
-    ir_interpret(&ir_ctx, &interpret_ctx);
+    if (ir_interpret(&ir_ctx, &interpret_ctx))
+      return 1;
   } else {
     FILE defer_var(auto_fclose) *out_file = fopen(options.output_name, "w");
     if (!out_file) {
       fprintf(stderr, "unable to open file '%s'\n", options.output_name);
       return 1;
     }
-    write_elf_file(&ir_ctx, out_file);
+    if (options.partial_eval)
+      write_partial_elf_file(&ir_ctx, &options, out_file);
+    else
+      write_elf_file(&ir_ctx, NULL, &options, out_file);
   }
   return 0;
 }
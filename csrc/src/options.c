@@ -1,20 +1,33 @@
 #include "options.h"
 #include "common.h"
+#include "ir_gen.h"
 #include <getopt.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
-static struct option long_options[] = {{"output", required_argument, NULL, 'o'},
-                                       {"compile", no_argument, NULL, 'c'},
-                                       {"dump", no_argument, NULL, 'd'},
-                                       {NULL, 0, NULL, 0}};
+/* loop iterations to run before giving up on reaching the first read */
+#define PARTIAL_EVAL_FUEL 1000000000ull
+
+static struct option long_options[] = {
+    {"output", required_argument, NULL, 'o'},
+    {"compile", no_argument, NULL, 'c'},
+    {"dump", no_argument, NULL, 'd'},
+    {"partial-eval", optional_argument, NULL, 'p'},
+    {"eof", required_argument, NULL, 'e'},
+    {"jit", no_argument, NULL, 'j'},
+    {"x86-64", no_argument, NULL, 'x'},
+    {"cell-bits", required_argument, NULL, 'b'},
+    {"tape-size", required_argument, NULL, 't'},
+    {"tail-calls", no_argument, NULL, 'T'},
+    {NULL, 0, NULL, 0}};
 
 int parse_options(options_t *options, int argc, char *const argv[]) {
   int c = 0;
   int compiling = 0;
-  while ((c = getopt_long(argc, argv, "dco:", long_options, NULL)) != -1) {
+  while ((c = getopt_long(argc, argv, "dco:p::e:jxb:t:T", long_options,
+                          NULL)) != -1) {
     switch (c) {
     case 'c':
       compiling = 1;
@@ -22,6 +35,56 @@ int parse_options(options_t *options, int argc, char *const argv[]) {
     case 'd':
       options->dump_ir = 1;
       break;
+    case 'j':
+      options->jit = 1;
+      break;
+    case 'x':
+      options->x86_64 = 1;
+      break;
+    case 'T':
+      options->tail_calls = 1;
+      break;
+    case 'p':
+      options->partial_eval = PARTIAL_EVAL_FUEL;
+      if (optarg && !(options->partial_eval = strtoull(optarg, NULL, 0))) {
+        fprintf(stderr, "invalid fuel '%s'\n", optarg);
+        goto error_ret;
+      }
+      break;
+    case 'e': {
+      /* unchanged, or the value to store, e.g. 0 or -1 */
+      char *end = NULL;
+      long eof = strtol(optarg, &end, 0);
+      if (!strcmp(optarg, "unchanged")) {
+        options->eof = EOF_UNCHANGED;
+      } else if (*optarg && !*end && eof >= INT8_MIN && eof <= UINT8_MAX) {
+        options->eof = eof;
+      } else {
+        fprintf(stderr, "invalid eof value '%s'\n", optarg);
+        goto error_ret;
+      }
+      break;
+    }
+    case 'b': {
+      char *end = NULL;
+      long bits = strtol(optarg, &end, 0);
+      if (*end || (bits != 8 && bits != 16 && bits != 32)) {
+        fprintf(stderr, "invalid cell size '%s', expected 8, 16 or 32\n",
+                optarg);
+        goto error_ret;
+      }
+      options->cell_bits = bits;
+      break;
+    }
+    case 't': {
+      char *end = NULL;
+      options->tape_size = strtoull(optarg, &end, 0);
+      if (*end || !options->tape_size) {
+        fprintf(stderr, "invalid tape size '%s'\n", optarg);
+        goto error_ret;
+      }
+      break;
+    }
     case 'o': {
       size_t len = strlen(optarg);
       options->output_name = realloc(NULL, len + 1);
@@ -0,0 +1,113 @@
+#!/bin/sh
+# runs the programs in bf_test every way bfcomp can run them and checks what
+# they print against test/expected, then the errors a program can run into.
+# run from csrc, usually as make check. usage: test/test_bf.sh [bfcomp]
+
+bfcomp=${1:-bin/bfcomp-c}
+programs=../bf_test
+expected=test/expected
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+pass_count=0
+fail_count=0
+
+# check description expected actual
+check() {
+  if cmp -s "$2" "$3"; then
+    echo "[PASS] $1"
+    pass_count=$((pass_count + 1))
+  else
+    echo "[FAIL] $1"
+    fail_count=$((fail_count + 1))
+  fi
+}
+
+# runs a program with the given flags, with its output and then its exit code
+# and errors in the files after it. with -c it is compiled and the binary runs
+run() {
+  program=$1
+  out=$2
+  err=$3
+  shift 3
+  case " $* " in
+  *" -c "*)
+    "$bfcomp" "$@" "$program" -o "$tmp/a.out" >/dev/null 2>"$err" &&
+      "$tmp/a.out" </dev/null >"$out" 2>"$err"
+    ;;
+  *)
+    "$bfcomp" "$@" "$program" </dev/null >"$out" 2>"$err"
+    ;;
+  esac
+  echo "exit $?" >>"$err"
+}
+
+# every program there is an expected output for, at the given cell width
+programs() {
+  bits=$1
+  shift
+  for f in "$expected/$bits"/*.out; do
+    name=$(basename "$f" .out)
+    run "$programs/$name.bf" "$tmp/out" "$tmp/err" --cell-bits="$bits" "$@"
+    check "$name.bf, $bits bit cells${*:+ $*}" "$f" "$tmp/out"
+  done
+}
+
+# a program that runs into an error, with the message and the exit code
+fails() {
+  desc=$1
+  source=$2
+  message=$3
+  shift 3
+  printf '%s\n' "$source" >"$tmp/fail.bf"
+  printf '%s\nexit 1\n' "$message" >"$tmp/expected_err"
+  run "$tmp/fail.bf" "$tmp/out" "$tmp/err" "$@"
+  check "$desc${*:+ $*}" "$tmp/expected_err" "$tmp/err"
+}
+
+# a program written out in full, with what it prints
+prints() {
+  desc=$1
+  source=$2
+  output=$3
+  shift 3
+  printf '%s\n' "$source" >"$tmp/prints.bf"
+  printf '%s' "$output" >"$tmp/expected_out"
+  run "$tmp/prints.bf" "$tmp/out" "$tmp/err" "$@"
+  check "$desc${*:+ $*}" "$tmp/expected_out" "$tmp/out"
+}
+
+for bits in 8 16 32; do
+  programs $bits
+  programs $bits --tail-calls
+  programs $bits --jit
+  programs $bits -c
+  programs $bits --x86-64 -c
+done
+programs 8 --partial-eval -c
+programs 8 --partial-eval --x86-64 -c
+
+for flags in "" -c; do
+  fails "unmatched [" "+[>+" "unmatched '['" $flags
+done
+
+# laps of the tape each way, which wrap back to where they started
+right=$(printf '%32768s' '' | tr ' ' '>')
+left=$(printf '%32768s' '' | tr ' ' '<')
+a="++++++++[>++++++++<-]>+"
+for flags in "" --tail-calls; do
+  prints "a lap of the default tape" "$a$right.$left." "AA" $flags
+  prints "laps of a 4096 cell tape" "$a$right.$left." "AA" -t 4096 $flags
+  prints "a lap of a 5 cell tape" "$a>>>>>.<<<<<." "AA" -t 5 $flags
+done
+
+for flags in -c "--x86-64 -c" "--partial-eval -c"; do
+  fails "off the left end" "<+." \
+    "out of bounds tape access at cell -1" $flags
+  fails "off the right end" "+[>+]" \
+    "out of bounds tape access at cell 32768" $flags
+  fails "off the right end of a 5 cell tape" "+[>+]" \
+    "out of bounds tape access at cell 5" -t 5 $flags
+done
+
+echo "$pass_count passed, $fail_count failed"
+[ "$fail_count" = 0 ]